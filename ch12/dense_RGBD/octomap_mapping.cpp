@@ -10,6 +10,37 @@ using namespace std;
 
 #include <Eigen/Geometry>
 #include <boost/format.hpp>  // for formating strings
+#include "backprojection.h"   // 共用的反投影，在仓库根目录的 common 下
+
+/// 一帧点云对八叉树的更新：击中的体素和射线穿过的空闲体素
+struct FrameUpdate {
+    octomap::KeySet occupied, free;
+    vector<octomap::OcTreeKey> ends;   // 去重后的射线终点，包括击中的体素和截断处的体素
+};
+
+/**
+ * 把一帧点云离散到体素上并去重，同一个体素里的点只投射一条射线
+ * @param max_range 大于 0 时，超出距离的点截断在 max_range 处，只更新空闲体素
+ */
+void discretizeFrame(const octomap::OcTree &tree, const slambook::PointBuffer &points, int frame,
+                     const octomap::point3d &origin, double max_range, FrameUpdate &update) {
+    octomap::KeySet clipped;
+    for (size_t k = points.frameBegin(frame); k < points.frameEnd(frame); k++) {
+        if (!points.valid[k]) continue;
+        octomap::point3d p(points.x[k], points.y[k], points.z[k]);
+        octomap::OcTreeKey key;
+        if (max_range > 0 && (p - origin).norm() > max_range) {
+            p = origin + (p - origin).normalized() * max_range;
+            if (tree.coordToKeyChecked(p, key)) clipped.insert(key);
+        } else if (tree.coordToKeyChecked(p, key)) {
+            update.occupied.insert(key);
+        }
+    }
+    update.ends.assign(update.occupied.begin(), update.occupied.end());
+    for (auto &key : clipped) {
+        if (!update.occupied.count(key)) update.ends.push_back(key);
+    }
+}
 
 int main(int argc, char **argv) {
     vector<cv::Mat> colorImgs, depthImgs;    // 彩色图和深度图
@@ -46,32 +77,70 @@ int main(int argc, char **argv) {
 
     cout << "正在将图像转换为 Octomap ..." << endl;
 
+    // 先把所有图像一起反投影到世界坐标系，按帧和行并行
+    slambook::RayTable rays(fx, fy, cx, cy, depthImgs[0].cols, depthImgs[0].rows);
+    slambook::PointBuffer points;
+    slambook::backProjectFrames(rays, depthImgs, colorImgs, depthScale, poses, points);
+
     // octomap tree 
     octomap::OcTree tree(0.01); // 参数为分辨率
 
-    for (int i = 0; i < 5; i++) {
-        cout << "转换图像中: " << i + 1 << endl;
-        cv::Mat color = colorImgs[i];
-        cv::Mat depth = depthImgs[i];
-        Eigen::Isometry3d T = poses[i];
-
-        octomap::Pointcloud cloud;  // the point cloud in octomap 
-
-        for (int v = 0; v < color.rows; v++)
-            for (int u = 0; u < color.cols; u++) {
-                unsigned int d = depth.ptr<unsigned short>(v)[u]; // 深度值
-                if (d == 0) continue; // 为0表示没有测量到
-                Eigen::Vector3d point;
-                point[2] = double(d) / depthScale;
-                point[0] = (u - cx) * point[2] / fx;
-                point[1] = (v - cy) * point[2] / fy;
-                Eigen::Vector3d pointWorld = T * point;
-                // 将世界坐标系的点放入点云
-                cloud.push_back(pointWorld[0], pointWorld[1], pointWorld[2]);
+    // 射线的最大长度，小于 0 表示不截断
+    double max_range = -1;
+
+    // octomap 的 insertPointCloud 逐点投射射线，而且是单线程的。
+    // 这里先把每帧点云离散到体素并去重，再把所有帧的射线分块并行投射，
+    // 最后按帧的顺序一次性写入八叉树
+    const int frames = poses.size();
+    vector<FrameUpdate> updates(frames);
+    vector<octomap::point3d> origins(frames);
+    for (int i = 0; i < frames; i++) {
+        origins[i] = octomap::point3d(poses[i](0, 3), poses[i](1, 3), poses[i](2, 3));
+    }
+    cv::parallel_for_(cv::Range(0, frames), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++) {
+            discretizeFrame(tree, points, i, origins[i], max_range, updates[i]);
+        }
+    });
+
+    // 每帧的终点切成若干块，每块是一个并行任务，各自记录经过的空闲体素
+    const size_t block_size = 2048;
+    vector<pair<int, size_t>> tasks;   // (帧, 起始终点)
+    for (int i = 0; i < frames; i++) {
+        for (size_t begin = 0; begin < updates[i].ends.size(); begin += block_size) {
+            tasks.push_back(make_pair(i, begin));
+        }
+    }
+    vector<octomap::KeySet> task_free(tasks.size());
+    cv::parallel_for_(cv::Range(0, tasks.size()), [&](const cv::Range &range) {
+        octomap::KeyRay ray;
+        for (int t = range.start; t < range.end; t++) {
+            const FrameUpdate &update = updates[tasks[t].first];
+            const octomap::point3d &origin = origins[tasks[t].first];
+            size_t end = min(tasks[t].second + block_size, update.ends.size());
+            for (size_t k = tasks[t].second; k < end; k++) {
+                if (tree.computeRayKeys(origin, tree.keyToCoord(update.ends[k]), ray)) {
+                    task_free[t].insert(ray.begin(), ray.end());
+                }
             }
+        }
+    });
+    for (size_t t = 0; t < tasks.size(); t++) {
+        updates[tasks[t].first].free.insert(task_free[t].begin(), task_free[t].end());
+        octomap::KeySet().swap(task_free[t]);
+    }
 
-        // 将点云存入八叉树地图，给定原点，这样可以计算投射线
-        tree.insertPointCloud(cloud, octomap::point3d(T(0, 3), T(1, 3), T(2, 3)));
+    // 同一帧里既被击中又被穿过的体素算作占据，和 insertPointCloud 一致
+    for (int i = 0; i < frames; i++) {
+        cout << "转换图像中: " << i + 1 << endl;
+        FrameUpdate &update = updates[i];
+        for (auto &key : update.free) {
+            if (!update.occupied.count(key)) tree.updateNode(key, false, true);
+        }
+        for (auto &key : update.occupied) {
+            tree.updateNode(key, true, true);
+        }
+        update = FrameUpdate();   // 释放这一帧的集合
     }
 
     // 更新中间节点的占据信息并写入磁盘
@@ -1,5 +1,7 @@
 #include <iostream>
 #include <fstream>
+#include <unordered_map>
+#include <memory>
 
 using namespace std;
 
@@ -9,100 +11,217 @@ using namespace std;
 #include <boost/format.hpp>  // for formating strings
 #include <pcl/point_types.h>
 #include <pcl/io/pcd_io.h>
-#include <pcl/filters/voxel_grid.h>
 #include <pcl/visualization/pcl_visualizer.h>
 #include <pcl/filters/statistical_outlier_removal.h>
+#include "backprojection.h"   // 共用的反投影，在仓库根目录的 common 下
 
-int main(int argc, char **argv) {
-    vector<cv::Mat> colorImgs, depthImgs;    // 彩色图和深度图
-    vector<Eigen::Isometry3d> poses;         // 相机位姿
+// 定义点云使用的格式：这里用的是XYZRGB
+typedef pcl::PointXYZRGB PointT;
+typedef pcl::PointCloud<PointT> PointCloud;
+
+/**
+ * 增量式体素哈希地图
+ * 每个体素保存落入其中的点的位置和颜色均值，每来一帧就融合进去，
+ * 内存只和体素个数有关，而不是和输入的像素总数有关。
+ * 哈希表分成若干个分片，同一个体素总是落在同一个分片里，因此各分片可以并行插入而无需加锁。
+ * 离相机较远的体素可以定期导出到文件并从内存中删除，保证内存有界。
+ */
+class VoxelHashMap {
+public:
+    VoxelHashMap(double resolution) : resolution_(resolution), shards_(NUM_SHARDS) {}
+
+    /// 把一帧点云融合进地图
+    void insert(const PointCloud &cloud) {
+        // 先算每个点所在的体素和分片，再按分片分组（计数排序）
+        const size_t n = cloud.size();
+        vector<int64_t> keys(n);
+        vector<int> shard_of(n);
+        vector<int> shard_count(NUM_SHARDS + 1, 0);
+        for (size_t i = 0; i < n; i++) {
+            keys[i] = voxelKey(cloud.points[i]);
+            shard_of[i] = shardIndex(keys[i]);
+            shard_count[shard_of[i] + 1]++;
+        }
+        for (int s = 0; s < NUM_SHARDS; s++) shard_count[s + 1] += shard_count[s];
+        vector<int> order(n);
+        vector<int> fill(shard_count.begin(), shard_count.end() - 1);
+        for (size_t i = 0; i < n; i++) order[fill[shard_of[i]]++] = i;
+
+        // 各分片互不相交，并行更新
+        cv::parallel_for_(cv::Range(0, NUM_SHARDS), [&](const cv::Range &range) {
+            for (int s = range.start; s < range.end; s++) {
+                auto &shard = shards_[s];
+                for (int k = shard_count[s]; k < shard_count[s + 1]; k++) {
+                    const PointT &p = cloud.points[order[k]];
+                    Voxel &voxel = shard[keys[order[k]]];
+                    voxel.count++;
+                    float w = 1.0f / voxel.count;   // 增量更新均值
+                    voxel.x += (p.x - voxel.x) * w;
+                    voxel.y += (p.y - voxel.y) * w;
+                    voxel.z += (p.z - voxel.z) * w;
+                    voxel.r += p.r;
+                    voxel.g += p.g;
+                    voxel.b += p.b;
+                }
+            }
+        });
+    }
+
+    /**
+     * 取出距离 center 超过 radius 的体素，并从地图中删除
+     * radius 小于 0 时取出全部体素
+     */
+    void extract(const Eigen::Vector3d &center, double radius, PointCloud &out) {
+        out.clear();
+        const double radius2 = radius * radius;
+        for (auto &shard : shards_) {
+            for (auto it = shard.begin(); it != shard.end();) {
+                const Voxel &voxel = it->second;
+                Eigen::Vector3d p(voxel.x, voxel.y, voxel.z);
+                if (radius >= 0 && (p - center).squaredNorm() <= radius2) {
+                    ++it;
+                    continue;
+                }
+                PointT point;
+                point.x = voxel.x;
+                point.y = voxel.y;
+                point.z = voxel.z;
+                point.r = voxel.r / voxel.count;
+                point.g = voxel.g / voxel.count;
+                point.b = voxel.b / voxel.count;
+                out.points.push_back(point);
+                it = shard.erase(it);
+            }
+        }
+        out.width = out.points.size();
+        out.height = 1;
+        out.is_dense = false;
+    }
+
+    size_t size() const {
+        size_t n = 0;
+        for (auto &shard : shards_) n += shard.size();
+        return n;
+    }
+
+private:
+    struct Voxel {
+        float x = 0, y = 0, z = 0;      // 位置均值
+        uint32_t r = 0, g = 0, b = 0;   // 颜色之和
+        uint32_t count = 0;
+    };
+
+    static const int NUM_SHARDS = 64;
+
+    // 每个轴 21 位，足够覆盖 0.01m 分辨率下 ±10km 的范围
+    int64_t voxelKey(const PointT &p) const {
+        const int64_t offset = 1 << 20, mask = (1 << 21) - 1;
+        int64_t ix = int64_t(floor(p.x / resolution_)) + offset;
+        int64_t iy = int64_t(floor(p.y / resolution_)) + offset;
+        int64_t iz = int64_t(floor(p.z / resolution_)) + offset;
+        return ((ix & mask) << 42) | ((iy & mask) << 21) | (iz & mask);
+    }
+
+    static int shardIndex(int64_t key) {
+        return int((uint64_t(key) * 0x9E3779B97F4A7C15ull) >> 58);   // 取乘法哈希的高 6 位
+    }
+
+    double resolution_;
+    vector<unordered_map<int64_t, Voxel>> shards_;
+};
 
+int main(int argc, char **argv) {
     ifstream fin("./data/pose.txt");
     if (!fin) {
         cerr << "cannot find pose file" << endl;
         return 1;
     }
 
-    for (int i = 0; i < 5; i++) {
-        boost::format fmt("./data/%s/%d.%s"); //图像文件格式
-        colorImgs.push_back(cv::imread((fmt % "color" % (i + 1) % "png").str()));
-        depthImgs.push_back(cv::imread((fmt % "depth" % (i + 1) % "png").str(), -1)); // 使用-1读取原始图像
-
-        double data[7] = {0};
-        for (int i = 0; i < 7; i++) {
-            fin >> data[i];
-        }
-        Eigen::Quaterniond q(data[6], data[3], data[4], data[5]);
-        Eigen::Isometry3d T(q);
-        T.pretranslate(Eigen::Vector3d(data[0], data[1], data[2]));
-        poses.push_back(T);
-    }
-
     // 计算点云并拼接
-    // 相机内参 
+    // 相机内参
     double cx = 319.5;
     double cy = 239.5;
     double fx = 481.2;
     double fy = -480.0;
     double depthScale = 5000.0;
 
+    // 体素地图参数
+    double resolution = 0.03;       // 体素大小
+    int export_interval = 50;       // 每隔多少帧导出一次远处的体素
+    double active_radius = 5.0;     // 离相机超过这个距离的体素会被导出
+
     cout << "正在将图像转换为点云..." << endl;
 
-    // 定义点云使用的格式：这里用的是XYZRGB
-    typedef pcl::PointXYZRGB PointT;
-    typedef pcl::PointCloud<PointT> PointCloud;
+    VoxelHashMap map(resolution);
+    unique_ptr<slambook::RayTable> rays;   // 读到第一张图后才知道图像大小
+    slambook::PointBuffer points;
+    boost::format fmt("./data/%s/%d.%s"); //图像文件格式
+    int num_chunks = 0;
+    size_t num_exported = 0;
+    int i = 0;
+
+    // 逐帧读入，读到位姿或图像不存在为止
+    for (;; i++) {
+        double data[7] = {0};
+        for (auto &d : data) fin >> d;
+        if (!fin) break;
+        cv::Mat color = cv::imread((fmt % "color" % (i + 1) % "png").str());
+        cv::Mat depth = cv::imread((fmt % "depth" % (i + 1) % "png").str(), -1); // 使用-1读取原始图像
+        if (color.data == nullptr || depth.data == nullptr) break;
+
+        Eigen::Quaterniond q(data[6], data[3], data[4], data[5]);
+        Eigen::Isometry3d T(q);
+        T.pretranslate(Eigen::Vector3d(data[0], data[1], data[2]));
 
-    // 新建一个点云
-    PointCloud::Ptr pointCloud(new PointCloud);
-    for (int i = 0; i < 5; i++) {
-        PointCloud::Ptr current(new PointCloud);
         cout << "转换图像中: " << i + 1 << endl;
-        cv::Mat color = colorImgs[i];
-        cv::Mat depth = depthImgs[i];
-        Eigen::Isometry3d T = poses[i];
-        for (int v = 0; v < color.rows; v++)
-            for (int u = 0; u < color.cols; u++) {
-                unsigned int d = depth.ptr<unsigned short>(v)[u]; // 深度值
-                if (d == 0) continue; // 为0表示没有测量到
-                Eigen::Vector3d point;
-                point[2] = double(d) / depthScale;
-                point[0] = (u - cx) * point[2] / fx;
-                point[1] = (v - cy) * point[2] / fy;
-                Eigen::Vector3d pointWorld = T * point;
-
-                PointT p;
-                p.x = pointWorld[0];
-                p.y = pointWorld[1];
-                p.z = pointWorld[2];
-                p.b = color.data[v * color.step + u * color.channels()];
-                p.g = color.data[v * color.step + u * color.channels() + 1];
-                p.r = color.data[v * color.step + u * color.channels() + 2];
-                current->points.push_back(p);
-            }
-        // depth filter and statistical removal 
+        if (!rays) rays.reset(new slambook::RayTable(fx, fy, cx, cy, depth.cols, depth.rows));
+        slambook::backProjectFrames(*rays, vector<cv::Mat>{depth}, vector<cv::Mat>{color}, depthScale,
+                                    vector<Eigen::Isometry3d, Eigen::aligned_allocator<Eigen::Isometry3d>>{T}, points);
+
+        PointCloud::Ptr current(new PointCloud);
+        current->points.reserve(points.countValid(0));
+        for (size_t k = 0; k < points.valid.size(); k++) {
+            if (!points.valid[k]) continue;
+            PointT p;
+            p.x = points.x[k];
+            p.y = points.y[k];
+            p.z = points.z[k];
+            p.b = points.b[k];
+            p.g = points.g[k];
+            p.r = points.r[k];
+            current->points.push_back(p);
+        }
+        current->width = current->points.size();
+        current->height = 1;
+
+        // depth filter and statistical removal
         PointCloud::Ptr tmp(new PointCloud);
         pcl::StatisticalOutlierRemoval<PointT> statistical_filter;
         statistical_filter.setMeanK(50);
         statistical_filter.setStddevMulThresh(1.0);
         statistical_filter.setInputCloud(current);
         statistical_filter.filter(*tmp);
-        (*pointCloud) += *tmp;
-    }
-
-    pointCloud->is_dense = false;
-    cout << "点云共有" << pointCloud->size() << "个点." << endl;
+        map.insert(*tmp);
 
-    // voxel filter 
-    pcl::VoxelGrid<PointT> voxel_filter;
-    double resolution = 0.03;
-    voxel_filter.setLeafSize(resolution, resolution, resolution);       // resolution
-    PointCloud::Ptr tmp(new PointCloud);
-    voxel_filter.setInputCloud(pointCloud);
-    voxel_filter.filter(*tmp);
-    tmp->swap(*pointCloud);
+        // 定期把远离相机的体素写到文件里，释放内存
+        if ((i + 1) % export_interval == 0) {
+            PointCloud chunk;
+            map.extract(T.translation(), active_radius, chunk);
+            if (!chunk.empty()) {
+                pcl::io::savePCDFileBinary((boost::format("map_chunk_%03d.pcd") % num_chunks++).str(), chunk);
+                num_exported += chunk.size();
+            }
+            cout << "地图中有" << map.size() << "个体素，已导出" << num_exported << "个." << endl;
+        }
+    }
 
-    cout << "滤波之后，点云共有" << pointCloud->size() << "个点." << endl;
+    PointCloud pointCloud;
+    map.extract(Eigen::Vector3d::Zero(), -1, pointCloud);
+    cout << "共处理" << i << "帧，滤波之后，点云共有" << pointCloud.size() + num_exported << "个点." << endl;
+    if (num_chunks > 0) {
+        cout << "较早的 " << num_exported << " 个点保存在 map_chunk_*.pcd 中" << endl;
+    }
 
-    pcl::io::savePCDFileBinary("map.pcd", *pointCloud);
+    if (!pointCloud.empty()) pcl::io::savePCDFileBinary("map.pcd", pointCloud);
     return 0;
-}
\ No newline at end of file
+}
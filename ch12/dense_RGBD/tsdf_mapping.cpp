@@ -0,0 +1,500 @@
+#include <iostream>
+#include <fstream>
+#include <vector>
+#include <array>
+#include <memory>
+#include <mutex>
+#include <chrono>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+#include <opencv2/core/core.hpp>
+#include <opencv2/highgui/highgui.hpp>
+#include <Eigen/Geometry>
+#include <boost/format.hpp>  // for formating strings
+#include "backprojection.h"   // 共用的反投影，在仓库根目录的 common 下
+
+// 本程序演示 TSDF 融合：体素按 8x8x8 分块，只有深度图附近的块才会被分配，块用哈希表索引。
+// 每帧先分配可见的块，再按块并行地更新 TSDF，最后只对变化过的块重新做 Marching Cubes。
+
+const int BLOCK_SIZE = 8;   // 每个块每边的体素个数
+const int BLOCK_VOXELS = BLOCK_SIZE * BLOCK_SIZE * BLOCK_SIZE;
+
+struct Voxel {
+    float tsdf = 1;     // 截断到 [-1, 1] 的符号距离，负数在表面后面
+    float weight = 0;   // 0 表示没有观测过
+    float r = 0, g = 0, b = 0;
+};
+
+struct MeshVertex {
+    float x, y, z;
+    uchar r, g, b;
+};
+
+struct VoxelBlock {
+    Eigen::Vector3i index;
+    Voxel voxels[BLOCK_VOXELS];
+    int last_frame = -1;         // 最后一次被融合的帧
+    bool mesh_dirty = false;     // 体素变化过，网格需要重新提取
+    vector<MeshVertex> mesh;     // 这个块的三角形，每三个顶点一个
+
+    Voxel &at(int x, int y, int z) { return voxels[(z * BLOCK_SIZE + y) * BLOCK_SIZE + x]; }
+};
+
+struct BlockHash {
+    size_t operator()(const Eigen::Vector3i &k) const {
+        return size_t(k[0]) * 73856093u ^ size_t(k[1]) * 19349669u ^ size_t(k[2]) * 83492791u;
+    }
+};
+
+/**
+ * Marching Cubes 的查找表：对 256 种角点内外组合，给出由哪些棱上的交点组成三角形
+ * 这里不手抄经典的大表，而是在启动时生成：在立方体的每个面上把交点连成线段，
+ * 线段首尾相接成环，再把每个环扇形三角化。面上有二义性时总是把里面的角点分开，
+ * 相邻的立方体看到的是同一个面，因此生成的网格在块之间也是连续的。
+ */
+class MarchingCubesTable {
+public:
+    int edge_corners[12][2];                     // 每条棱的两个角点
+    vector<array<int, 3>> triangles[256];        // 每种情况的三角形，元素是棱的编号
+
+    // 角点 i 的坐标为 (i & 1, (i >> 1) & 1, (i >> 2) & 1)
+    static Eigen::Vector3f corner(int i) {
+        return Eigen::Vector3f(i & 1, (i >> 1) & 1, (i >> 2) & 1);
+    }
+
+    MarchingCubesTable() {
+        int edge_id[8][8];
+        int num_edges = 0;
+        for (int c = 0; c < 8; c++)
+            for (int a = 0; a < 3; a++) {
+                if (c >> a & 1) continue;
+                int c1 = c | (1 << a);
+                edge_corners[num_edges][0] = c;
+                edge_corners[num_edges][1] = c1;
+                edge_id[c][c1] = edge_id[c1][c] = num_edges++;
+            }
+
+        // 六个面，每个面的四个角点按环的顺序排列
+        int faces[6][4];
+        for (int a = 0, f = 0; a < 3; a++)
+            for (int s = 0; s < 2; s++, f++) {
+                int b = (a + 1) % 3, c = (a + 2) % 3;
+                const int pattern[4][2] = {{0, 0}, {1, 0}, {1, 1}, {0, 1}};
+                for (int k = 0; k < 4; k++)
+                    faces[f][k] = (s << a) | (pattern[k][0] << b) | (pattern[k][1] << c);
+            }
+
+        for (int config = 0; config < 256; config++) {
+            auto inside = [config](int c) { return (config >> c & 1) == 1; };
+            vector<vector<int>> adj(12);
+            auto connect = [&adj](int e0, int e1) {
+                adj[e0].push_back(e1);
+                adj[e1].push_back(e0);
+            };
+            for (auto &q : faces) {
+                int crossing[4], num_crossing = 0;
+                for (int k = 0; k < 4; k++) {
+                    if (inside(q[k]) != inside(q[(k + 1) % 4]))
+                        crossing[num_crossing++] = edge_id[q[k]][q[(k + 1) % 4]];
+                }
+                if (num_crossing == 2) {
+                    connect(crossing[0], crossing[1]);
+                } else if (num_crossing == 4) {
+                    // 二义的面：每个里面的角点单独用一条线段切出来
+                    for (int k = 0; k < 4; k++) {
+                        if (!inside(q[k])) continue;
+                        connect(edge_id[q[(k + 3) % 4]][q[k]], edge_id[q[k]][q[(k + 1) % 4]]);
+                    }
+                }
+            }
+
+            // 把线段连成环
+            bool visited[12] = {false};
+            for (int start = 0; start < 12; start++) {
+                if (visited[start] || adj[start].empty()) continue;
+                vector<int> loop;
+                int prev = -1, cur = start;
+                while (!visited[cur]) {
+                    visited[cur] = true;
+                    loop.push_back(cur);
+                    int next = adj[cur][0] == prev ? adj[cur][1] : adj[cur][0];
+                    prev = cur;
+                    cur = next;
+                }
+
+                // 让法向指向外面（TSDF 为正的一侧）
+                Eigen::Vector3f normal = Eigen::Vector3f::Zero(), gradient = Eigen::Vector3f::Zero();
+                for (size_t k = 0; k < loop.size(); k++) {
+                    int e = loop[k];
+                    Eigen::Vector3f p0 = midpoint(e), p1 = midpoint(loop[(k + 1) % loop.size()]);
+                    normal += p0.cross(p1);
+                    int c_in = edge_corners[e][0], c_out = edge_corners[e][1];
+                    if (!inside(c_in)) swap(c_in, c_out);
+                    gradient += corner(c_out) - corner(c_in);
+                }
+                if (normal.dot(gradient) < 0) reverse(loop.begin(), loop.end());
+
+                for (size_t k = 1; k + 1 < loop.size(); k++) {
+                    triangles[config].push_back({{loop[0], loop[k], loop[k + 1]}});
+                }
+            }
+        }
+    }
+
+private:
+    Eigen::Vector3f midpoint(int e) const {
+        return 0.5f * (corner(edge_corners[e][0]) + corner(edge_corners[e][1]));
+    }
+};
+
+/**
+ * 基于体素块哈希的 TSDF 地图
+ * 块从一个有上限的池子里分配，池子满了就回收最久没被观测到的块，
+ * 回收前把它的网格保存下来，因此内存有界而网格不丢。
+ */
+class TsdfVolume {
+public:
+    TsdfVolume(double voxel_size, double truncation, double max_depth, int max_blocks)
+        : voxel_size_(voxel_size), truncation_(truncation), max_depth_(max_depth), max_blocks_(max_blocks) {}
+
+    /**
+     * 融合一帧深度图
+     * @param rays 相机的归一化坐标表
+     * @param K 内参 fx, fy, cx, cy
+     * @param T_wc 相机位姿
+     */
+    void integrate(const slambook::RayTable &rays, const Eigen::Vector4d &K, const cv::Mat &depth,
+                   const cv::Mat &color, double depth_scale, const Eigen::Isometry3d &T_wc, int frame_id) {
+        vector<int> visible = allocateBlocks(rays, depth, depth_scale, T_wc, frame_id);
+
+        const Eigen::Isometry3f T_cw = T_wc.inverse().cast<float>();
+        const float fx = K[0], fy = K[1], cx = K[2], cy = K[3];
+        const float scale_inv = float(1.0 / depth_scale), trunc = truncation_, vs = voxel_size_;
+        const float max_weight = 100;
+        vector<uchar> updated(visible.size(), 0);
+
+        cv::parallel_for_(cv::Range(0, visible.size()), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) {
+                VoxelBlock &block = *pool_[visible[i]];
+                // 体素在相机系下的坐标沿三个轴是等差的，增量计算
+                Eigen::Vector3f p0 = T_cw * (block.index.cast<float>() * (BLOCK_SIZE * vs));
+                Eigen::Vector3f dx = T_cw.linear().col(0) * vs, dy = T_cw.linear().col(1) * vs,
+                    dz = T_cw.linear().col(2) * vs;
+                for (int z = 0; z < BLOCK_SIZE; z++)
+                    for (int y = 0; y < BLOCK_SIZE; y++) {
+                        Eigen::Vector3f p = p0 + y * dy + z * dz;
+                        for (int x = 0; x < BLOCK_SIZE; x++, p += dx) {
+                            if (p[2] <= 0) continue;
+                            int u = cvRound(fx * p[0] / p[2] + cx), v = cvRound(fy * p[1] / p[2] + cy);
+                            if (u < 0 || v < 0 || u >= depth.cols || v >= depth.rows) continue;
+                            float d = depth.ptr<unsigned short>(v)[u] * scale_inv;
+                            if (d <= 0 || d > max_depth_) continue;
+                            float sdf = d - p[2];
+                            if (sdf < -trunc) continue;   // 在表面后面太远，看不到
+
+                            float tsdf = min(1.0f, sdf / trunc);
+                            Voxel &voxel = block.at(x, y, z);
+                            float w = voxel.weight, w_inv = 1.0f / (w + 1);
+                            const uchar *c = color.ptr<uchar>(v) + 3 * u;
+                            voxel.tsdf = (voxel.tsdf * w + tsdf) * w_inv;
+                            voxel.b = (voxel.b * w + c[0]) * w_inv;
+                            voxel.g = (voxel.g * w + c[1]) * w_inv;
+                            voxel.r = (voxel.r * w + c[2]) * w_inv;
+                            voxel.weight = min(w + 1, max_weight);
+                            updated[i] = 1;
+                        }
+                    }
+            }
+        });
+
+        // 一个块变了，以它为 +x/+y/+z 邻居的块的网格也要更新
+        for (size_t i = 0; i < visible.size(); i++) {
+            if (!updated[i]) continue;
+            const Eigen::Vector3i &index = pool_[visible[i]]->index;
+            for (int n = 0; n < 8; n++) {
+                auto it = blocks_.find(index - Eigen::Vector3i(n & 1, (n >> 1) & 1, (n >> 2) & 1));
+                if (it != blocks_.end()) pool_[it->second]->mesh_dirty = true;
+            }
+        }
+    }
+
+    /// 对网格过期的块重新做 Marching Cubes，返回更新的块数
+    int updateMesh() {
+        vector<int> dirty;
+        for (auto &kv : blocks_) {
+            if (pool_[kv.second]->mesh_dirty) dirty.push_back(kv.second);
+        }
+        cv::parallel_for_(cv::Range(0, dirty.size()), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) extractBlockMesh(*pool_[dirty[i]]);
+        });
+        return dirty.size();
+    }
+
+    /// 把所有块的网格（包括被回收的块）写成 ply
+    void saveMesh(const string &file) const {
+        vector<const vector<MeshVertex> *> parts{&archived_mesh_};
+        for (auto &kv : blocks_) parts.push_back(&pool_[kv.second]->mesh);
+        size_t num_vertices = 0;
+        for (auto part : parts) num_vertices += part->size();
+
+        ofstream fout(file, ios::binary);
+        fout << "ply\nformat binary_little_endian 1.0\n"
+             << "element vertex " << num_vertices << "\n"
+             << "property float x\nproperty float y\nproperty float z\n"
+             << "property uchar red\nproperty uchar green\nproperty uchar blue\n"
+             << "element face " << num_vertices / 3 << "\n"
+             << "property list uchar int vertex_indices\n"
+             << "end_header\n";
+        for (auto part : parts)
+            for (auto &v : *part) {
+                fout.write((const char *) &v.x, 3 * sizeof(float));
+                fout.write((const char *) &v.r, 3);
+            }
+        for (size_t i = 0; i < num_vertices; i += 3) {
+            uchar n = 3;
+            int face[3] = {int(i), int(i + 1), int(i + 2)};
+            fout.write((const char *) &n, 1);
+            fout.write((const char *) face, sizeof(face));
+        }
+    }
+
+    size_t numBlocks() const { return blocks_.size(); }
+
+private:
+    /// 分配深度测量附近截断带内的块，返回这一帧可见的块
+    vector<int> allocateBlocks(const slambook::RayTable &rays, const cv::Mat &depth, double depth_scale,
+                               const Eigen::Isometry3d &T_wc, int frame_id) {
+        typedef unordered_set<Eigen::Vector3i, BlockHash> KeySet;
+        KeySet keys;
+        mutex keys_mutex;
+        const Eigen::Isometry3f T = T_wc.cast<float>();
+        const float scale_inv = float(1.0 / depth_scale), trunc = truncation_;
+        const float block_inv = float(1.0 / (BLOCK_SIZE * voxel_size_));
+        const float step = min(trunc, float(0.5 * BLOCK_SIZE * voxel_size_));
+        const int stride = 2;   // 块比像素大得多，隔一个像素采样就够了
+
+        cv::parallel_for_(cv::Range(0, (depth.rows + stride - 1) / stride), [&](const cv::Range &range) {
+            KeySet local;
+            for (int v = range.start * stride; v < min(range.end * stride, depth.rows); v += stride) {
+                const unsigned short *d_row = depth.ptr<unsigned short>(v);
+                const float *rx = rays.rayX(v), *ry = rays.rayY(v);
+                for (int u = 0; u < depth.cols; u += stride) {
+                    float d = d_row[u] * scale_inv;
+                    if (d <= 0 || d > max_depth_) continue;
+                    Eigen::Vector3f ray(rx[u], ry[u], 1);
+                    for (float s = d - trunc;; s = min(s + step, d + trunc)) {
+                        Eigen::Vector3f p = T * (ray * s) * block_inv;
+                        local.insert(Eigen::Vector3i(int(floor(p[0])), int(floor(p[1])), int(floor(p[2]))));
+                        if (s >= d + trunc) break;
+                    }
+                }
+            }
+            unique_lock<mutex> lck(keys_mutex);
+            keys.insert(local.begin(), local.end());
+        });
+
+        // 新块不够用时回收最久没有观测到的块
+        // 先给当前帧已经有的块记上帧号，回收时不会把它们当成旧块
+        int num_new = 0;
+        for (auto &k : keys) {
+            auto it = blocks_.find(k);
+            if (it == blocks_.end()) num_new++;
+            else pool_[it->second]->last_frame = frame_id;
+        }
+        int num_available = int(free_list_.size()) + max_blocks_ - int(pool_.size());
+        if (num_new > num_available) recycleBlocks(num_new - num_available, frame_id);
+
+        vector<int> visible;
+        visible.reserve(keys.size());
+        int num_dropped = 0;
+        for (auto &k : keys) {
+            auto it = blocks_.find(k);
+            int id;
+            if (it != blocks_.end()) {
+                id = it->second;
+            } else {
+                id = newBlock(k);
+                if (id < 0) {
+                    num_dropped++;
+                    continue;
+                }
+            }
+            pool_[id]->last_frame = frame_id;
+            visible.push_back(id);
+        }
+        if (num_dropped > 0) {
+            cerr << "block pool is full, " << num_dropped << " blocks are not allocated" << endl;
+        }
+        return visible;
+    }
+
+    int newBlock(const Eigen::Vector3i &index) {
+        int id;
+        if (!free_list_.empty()) {
+            id = free_list_.back();
+            free_list_.pop_back();
+            *pool_[id] = VoxelBlock();
+        } else if (int(pool_.size()) < max_blocks_) {
+            id = pool_.size();
+            pool_.emplace_back(new VoxelBlock);
+        } else {
+            return -1;
+        }
+        pool_[id]->index = index;
+        blocks_[index] = id;
+        return id;
+    }
+
+    /// 回收 n 个最久没被观测的块，当前帧用到的块不回收
+    void recycleBlocks(int n, int frame_id) {
+        vector<pair<int, int>> candidates;   // (last_frame, id)
+        for (auto &kv : blocks_) {
+            if (pool_[kv.second]->last_frame < frame_id)
+                candidates.push_back(make_pair(pool_[kv.second]->last_frame, kv.second));
+        }
+        n = min(n, int(candidates.size()));
+        partial_sort(candidates.begin(), candidates.begin() + n, candidates.end());
+        // 先在所有邻居都还在的时候提取网格，再删除
+        for (int i = 0; i < n; i++) {
+            VoxelBlock &block = *pool_[candidates[i].second];
+            if (block.mesh_dirty) extractBlockMesh(block);
+        }
+        for (int i = 0; i < n; i++) {
+            VoxelBlock &block = *pool_[candidates[i].second];
+            archived_mesh_.insert(archived_mesh_.end(), block.mesh.begin(), block.mesh.end());
+            blocks_.erase(block.index);
+            block.mesh = vector<MeshVertex>();
+            free_list_.push_back(candidates[i].second);
+            // 以它为 +x/+y/+z 邻居的块的网格用到了它的体素，要重新提取
+            for (int k = 1; k < 8; k++) {
+                auto it = blocks_.find(block.index - Eigen::Vector3i(k & 1, (k >> 1) & 1, (k >> 2) & 1));
+                if (it != blocks_.end()) pool_[it->second]->mesh_dirty = true;
+            }
+        }
+    }
+
+    /// 对一个块做 Marching Cubes，立方体的 +x/+y/+z 角点可能在相邻的块里
+    void extractBlockMesh(VoxelBlock &block) const {
+        static const MarchingCubesTable table;
+        const int N = BLOCK_SIZE + 1;
+
+        // 把本块和七个相邻块的体素收集到 9x9x9 的网格里
+        vector<const Voxel *> grid(N * N * N, nullptr);
+        for (int n = 0; n < 8; n++) {
+            Eigen::Vector3i offset(n & 1, (n >> 1) & 1, (n >> 2) & 1);
+            auto it = blocks_.find(block.index + offset);
+            if (it == blocks_.end()) continue;
+            VoxelBlock &neighbor = *pool_[it->second];
+            for (int z = offset[2] * BLOCK_SIZE; z < (offset[2] ? N : BLOCK_SIZE); z++)
+                for (int y = offset[1] * BLOCK_SIZE; y < (offset[1] ? N : BLOCK_SIZE); y++)
+                    for (int x = offset[0] * BLOCK_SIZE; x < (offset[0] ? N : BLOCK_SIZE); x++) {
+                        grid[(z * N + y) * N + x] =
+                            &neighbor.at(x - offset[0] * BLOCK_SIZE, y - offset[1] * BLOCK_SIZE,
+                                         z - offset[2] * BLOCK_SIZE);
+                    }
+        }
+
+        block.mesh.clear();
+        const Eigen::Vector3f origin = block.index.cast<float>() * (BLOCK_SIZE * voxel_size_);
+        for (int z = 0; z < BLOCK_SIZE; z++)
+            for (int y = 0; y < BLOCK_SIZE; y++)
+                for (int x = 0; x < BLOCK_SIZE; x++) {
+                    const Voxel *corners[8];
+                    int config = 0;
+                    bool valid = true;
+                    for (int c = 0; c < 8 && valid; c++) {
+                        corners[c] = grid[((z + (c >> 2 & 1)) * N + y + (c >> 1 & 1)) * N + x + (c & 1)];
+                        valid = corners[c] != nullptr && corners[c]->weight > 0;
+                        if (valid && corners[c]->tsdf < 0) config |= 1 << c;
+                    }
+                    if (!valid || config == 0 || config == 255) continue;
+
+                    // 在棱上线性插值出零点
+                    Eigen::Vector3f base = origin + Eigen::Vector3f(x, y, z) * voxel_size_;
+                    for (auto &tri : table.triangles[config])
+                        for (int e : tri) {
+                            int c0 = table.edge_corners[e][0], c1 = table.edge_corners[e][1];
+                            const Voxel &v0 = *corners[c0], &v1 = *corners[c1];
+                            float t = v0.tsdf / (v0.tsdf - v1.tsdf);
+                            Eigen::Vector3f p = base + voxel_size_ *
+                                (MarchingCubesTable::corner(c0) +
+                                 t * (MarchingCubesTable::corner(c1) - MarchingCubesTable::corner(c0)));
+                            MeshVertex vertex;
+                            vertex.x = p[0];
+                            vertex.y = p[1];
+                            vertex.z = p[2];
+                            vertex.r = uchar(v0.r + t * (v1.r - v0.r));
+                            vertex.g = uchar(v0.g + t * (v1.g - v0.g));
+                            vertex.b = uchar(v0.b + t * (v1.b - v0.b));
+                            block.mesh.push_back(vertex);
+                        }
+                }
+        block.mesh_dirty = false;
+    }
+
+    float voxel_size_, truncation_, max_depth_;
+    int max_blocks_;
+    vector<unique_ptr<VoxelBlock>> pool_;   // 最多 max_blocks_ 个块
+    vector<int> free_list_;                 // 池子里被回收的块
+    unordered_map<Eigen::Vector3i, int, BlockHash> blocks_;
+    vector<MeshVertex> archived_mesh_;      // 被回收的块留下的网格
+};
+
+int main(int argc, char **argv) {
+    ifstream fin("./data/pose.txt");
+    if (!fin) {
+        cerr << "cannot find pose file" << endl;
+        return 1;
+    }
+
+    // 相机内参
+    double cx = 319.5;
+    double cy = 239.5;
+    double fx = 481.2;
+    double fy = -480.0;
+    double depthScale = 5000.0;
+
+    // TSDF 参数
+    double voxel_size = 0.02;        // 体素大小
+    double truncation = 0.08;        // 截断距离，约为四个体素
+    double max_depth = 5.0;          // 更远的深度不可靠，不参与融合
+    int max_blocks = 20000;          // 最多同时保留的块数，每个块约 10KB
+    int mesh_interval = 10;          // 每隔多少帧更新一次网格
+
+    TsdfVolume volume(voxel_size, truncation, max_depth, max_blocks);
+    unique_ptr<slambook::RayTable> rays;   // 读到第一张图后才知道图像大小
+    boost::format fmt("./data/%s/%d.%s"); //图像文件格式
+    int i = 0;
+
+    cout << "正在融合 TSDF ..." << endl;
+    for (;; i++) {
+        double data[7] = {0};
+        for (auto &d : data) fin >> d;
+        if (!fin) break;
+        cv::Mat color = cv::imread((fmt % "color" % (i + 1) % "png").str());
+        cv::Mat depth = cv::imread((fmt % "depth" % (i + 1) % "png").str(), -1); // 使用-1读取原始图像
+        if (color.data == nullptr || depth.data == nullptr) break;
+
+        Eigen::Quaterniond q(data[6], data[3], data[4], data[5]);
+        Eigen::Isometry3d T(q);
+        T.pretranslate(Eigen::Vector3d(data[0], data[1], data[2]));
+        if (!rays) rays.reset(new slambook::RayTable(fx, fy, cx, cy, depth.cols, depth.rows));
+
+        chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+        volume.integrate(*rays, Eigen::Vector4d(fx, fy, cx, cy), depth, color, depthScale, T, i);
+        int num_meshed = (i + 1) % mesh_interval == 0 ? volume.updateMesh() : 0;
+        chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+        chrono::duration<double> time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+        cout << "frame " << i + 1 << ": " << volume.numBlocks() << " blocks, " << num_meshed
+             << " meshed, time " << time_used.count() * 1000 << " ms" << endl;
+    }
+
+    volume.updateMesh();
+    cout << "共融合" << i << "帧，保存网格到 mesh.ply" << endl;
+    volume.saveMesh("mesh.ply");
+    return 0;
+}
@@ -1,6 +1,9 @@
 #include <iostream>
 #include <vector>
 #include <fstream>
+#include <chrono>
+#include <atomic>
+#include <algorithm>
 
 using namespace std;
 
@@ -21,6 +24,8 @@ using namespace Eigen;
 #include <opencv2/highgui/highgui.hpp>
 #include <opencv2/imgproc/imgproc.hpp>
 
+#include "image_sampling.h"    // 共用的双线性插值，在仓库根目录的 common 下
+
 using namespace cv;
 
 /**********************************************
@@ -42,6 +47,16 @@ const int ncc_window_size = 3;    // NCC 取的窗口半宽度
 const int ncc_area = (2 * ncc_window_size + 1) * (2 * ncc_window_size + 1); // NCC窗口面积
 const double min_cov = 0.1;     // 收敛判定：最小方差
 const double max_cov = 10;      // 发散判定：最大方差
+const int pyramid_levels = 3;   // 极线搜索的金字塔层数，每层缩小一半，为 1 时只在原图上搜索
+const double coarse_min_half_length = 4;    // 极线在某层上的半长度不小于这么多像素时，才从这一层开始搜
+
+// ------------------------------------------------------------------
+// 参考图像，以及每个像素处 NCC 窗口的均值和去均值后的模长
+// 参考图像在整个过程中不变，这些统计量用积分图一次算好，匹配时不再重复计算
+struct RefImage {
+    Mat img;            // CV_8U 灰度图
+    Mat mean, norm;     // CV_32F
+};
 
 // ------------------------------------------------------------------
 // 重要的函数
@@ -53,27 +68,36 @@ bool readDatasetFiles(
     cv::Mat &ref_depth
 );
 
+/// 用积分图计算参考图像每个像素的 NCC 窗口统计量
+RefImage computeRefImage(const Mat &img);
+
+/// 构建图像金字塔，第 0 层为原图
+vector<Mat> buildPyramid(const Mat &img);
+
 /**
- * 根据新的图像更新深度估计
- * @param ref           参考图像
- * @param curr          当前图像
+ * 根据新的图像更新深度估计，只处理还在活跃列表里的种子，
+ * 更新后已收敛或发散的种子从列表中移除
+ * @param ref_pyr       参考图像金字塔及其窗口统计量
+ * @param curr_pyr      当前图像金字塔
  * @param T_C_R         参考图像到当前图像的位姿
- * @param depth         深度
- * @param depth_cov     深度方差
+ * @param seeds         活跃种子的像素坐标，按行优先排列
+ * @param depth         深度，CV_32F
+ * @param depth_cov     深度方差，CV_32F
  * @return              是否成功
  */
 bool update(
-    const Mat &ref,
-    const Mat &curr,
+    const vector<RefImage> &ref_pyr,
+    const vector<Mat> &curr_pyr,
     const SE3d &T_C_R,
+    vector<Point> &seeds,
     Mat &depth,
     Mat &depth_cov2
 );
 
 /**
- * 极线搜索
- * @param ref           参考图像
- * @param curr          当前图像
+ * 极线搜索，极线较长时先在金字塔的粗层上搜索整段极线，再逐层在上一层的最优点附近细化
+ * @param ref_pyr       参考图像金字塔及其窗口统计量
+ * @param curr_pyr      当前图像金字塔
  * @param T_C_R         位姿
  * @param pt_ref        参考图像中点的位置
  * @param depth_mu      深度均值
@@ -83,8 +107,8 @@ bool update(
  * @return              是否成功
  */
 bool epipolarSearch(
-    const Mat &ref,
-    const Mat &curr,
+    const vector<RefImage> &ref_pyr,
+    const vector<Mat> &curr_pyr,
     const SE3d &T_C_R,
     const Vector2d &pt_ref,
     const double &depth_mu,
@@ -114,24 +138,14 @@ bool updateDepthFilter(
 
 /**
  * 计算 NCC 评分
- * @param ref       参考图像
+ * @param ref_patch 去均值后的参考窗口，按行存放
+ * @param ref_mean  参考窗口的均值
+ * @param ref_norm  去均值后参考窗口的模长
  * @param curr      当前图像
- * @param pt_ref    参考点
  * @param pt_curr   当前点
  * @return          NCC评分
  */
-double NCC(const Mat &ref, const Mat &curr, const Vector2d &pt_ref, const Vector2d &pt_curr);
-
-// 双线性灰度插值
-inline double getBilinearInterpolatedValue(const Mat &img, const Vector2d &pt) {
-    uchar *d = &img.data[int(pt(1, 0)) * img.step + int(pt(0, 0))];
-    double xx = pt(0, 0) - floor(pt(0, 0));
-    double yy = pt(1, 0) - floor(pt(1, 0));
-    return ((1 - xx) * (1 - yy) * double(d[0]) +
-            xx * (1 - yy) * double(d[1]) +
-            (1 - xx) * yy * double(d[img.step]) +
-            xx * yy * double(d[img.step + 1])) / 255.0;
-}
+float NCC(const float *ref_patch, float ref_mean, float ref_norm, const Mat &curr, const Vector2d &pt_curr);
 
 // ------------------------------------------------------------------
 // 一些小工具
@@ -191,12 +205,21 @@ int main(int argc, char **argv) {
     cout << "read total " << color_image_files.size() << " files." << endl;
 
     // 第一张图
-    Mat ref = imread(color_image_files[0], 0);                // gray-scale image
+    vector<RefImage> ref_pyr;   // 参考图像的金字塔，每层都预先算好 NCC 窗口统计量
+    for (auto &img : buildPyramid(imread(color_image_files[0], 0)))    // gray-scale image
+        ref_pyr.push_back(computeRefImage(img));
     SE3d pose_ref_TWC = poses_TWC[0];
     double init_depth = 3.0;    // 深度初始值
     double init_cov2 = 3.0;     // 方差初始值
-    Mat depth(height, width, CV_64F, init_depth);             // 深度图
-    Mat depth_cov2(height, width, CV_64F, init_cov2);         // 深度图方差
+    Mat depth(height, width, CV_32F, init_depth);             // 深度图
+    Mat depth_cov2(height, width, CV_32F, init_cov2);         // 深度图方差
+
+    // 活跃种子：还没有收敛也没有发散的像素，一开始是边框内的所有像素
+    vector<Point> seeds;
+    seeds.reserve((width - 2 * boarder) * (height - 2 * boarder));
+    for (int y = boarder; y < height - boarder; y++)
+        for (int x = boarder; x < width - boarder; x++)
+            seeds.push_back(Point(x, y));
 
     for (int index = 1; index < color_image_files.size(); index++) {
         cout << "*** loop " << index << " ***" << endl;
@@ -204,7 +227,7 @@ int main(int argc, char **argv) {
         if (curr.data == nullptr) continue;
         SE3d pose_curr_TWC = poses_TWC[index];
         SE3d pose_T_C_R = pose_curr_TWC.inverse() * pose_ref_TWC;   // 坐标转换关系： T_C_W * T_W_R = T_C_R
-        update(ref, curr, pose_T_C_R, depth, depth_cov2);
+        update(ref_pyr, buildPyramid(curr), pose_T_C_R, seeds, depth, depth_cov2);
         evaludateDepth(ref_depth, depth);
         plotDepth(ref_depth, depth);
         imshow("image", curr);
@@ -244,35 +267,71 @@ bool readDatasetFiles(
 
     // load reference depth
     fin.open(path + "/depthmaps/scene_000.depth");
-    ref_depth = cv::Mat(height, width, CV_64F);
+    ref_depth = cv::Mat(height, width, CV_32F);
     if (!fin) return false;
     for (int y = 0; y < height; y++)
         for (int x = 0; x < width; x++) {
             double depth = 0;
             fin >> depth;
-            ref_depth.ptr<double>(y)[x] = depth / 100.0;
+            ref_depth.ptr<float>(y)[x] = depth / 100.0;
         }
 
     return true;
 }
 
-// 对整个深度图进行更新
-bool update(const Mat &ref, const Mat &curr, const SE3d &T_C_R, Mat &depth, Mat &depth_cov2) {
-    for (int x = boarder; x < width - boarder; x++)
-        for (int y = boarder; y < height - boarder; y++) {
-            // 遍历每个像素
-            if (depth_cov2.ptr<double>(y)[x] < min_cov || depth_cov2.ptr<double>(y)[x] > max_cov) // 深度已收敛或发散
-                continue;
+RefImage computeRefImage(const Mat &img) {
+    RefImage ref;
+    ref.img = img;
+    ref.mean = Mat(img.rows, img.cols, CV_32F, Scalar(0));
+    ref.norm = Mat(img.rows, img.cols, CV_32F, Scalar(0));
+
+    Mat sum, sqsum;
+    cv::integral(img, sum, sqsum, CV_64F, CV_64F);
+    const int w = ncc_window_size;
+    for (int y = w; y < img.rows - w; y++)
+        for (int x = w; x < img.cols - w; x++) {
+            // 窗口 [x-w, x+w] x [y-w, y+w] 的和
+            double s = sum.at<double>(y + w + 1, x + w + 1) - sum.at<double>(y - w, x + w + 1)
+                       - sum.at<double>(y + w + 1, x - w) + sum.at<double>(y - w, x - w);
+            double s2 = sqsum.at<double>(y + w + 1, x + w + 1) - sqsum.at<double>(y - w, x + w + 1)
+                        - sqsum.at<double>(y + w + 1, x - w) + sqsum.at<double>(y - w, x - w);
+            double mean = s / ncc_area;
+            ref.mean.ptr<float>(y)[x] = mean;
+            ref.norm.ptr<float>(y)[x] = sqrt(max(0.0, s2 - s * mean));
+        }
+    return ref;
+}
+
+vector<Mat> buildPyramid(const Mat &img) {
+    vector<Mat> pyramid(pyramid_levels);
+    pyramid[0] = img;
+    for (int i = 1; i < pyramid_levels; i++) cv::pyrDown(pyramid[i - 1], pyramid[i]);
+    return pyramid;
+}
+
+// 对活跃种子进行更新
+// 各像素的深度滤波器相互独立，且每个种子只写自己位置上的 depth 和 depth_cov2，
+// 因此可以把种子列表分段并行而不需要加锁。每帧的工作量只和还在活跃的种子数有关
+bool update(const vector<RefImage> &ref_pyr, const vector<Mat> &curr_pyr, const SE3d &T_C_R,
+            vector<Point> &seeds, Mat &depth, Mat &depth_cov2) {
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    const int num_seeds = seeds.size();
+    const int seeds_per_task = 1024;            // 每个任务处理的种子数
+    atomic<int> updated(0);
+    cv::parallel_for_(cv::Range(0, num_seeds), [&](const cv::Range &range) {
+        int updated_local = 0;
+        for (int i = range.start; i < range.end; i++) {
+            const int x = seeds[i].x, y = seeds[i].y;
             // 在极线上搜索 (x,y) 的匹配
             Vector2d pt_curr;
             Vector2d epipolar_direction;
             bool ret = epipolarSearch(
-                ref,
-                curr,
+                ref_pyr,
+                curr_pyr,
                 T_C_R,
                 Vector2d(x, y),
-                depth.ptr<double>(y)[x],
-                sqrt(depth_cov2.ptr<double>(y)[x]),
+                depth.ptr<float>(y)[x],
+                sqrt(depth_cov2.ptr<float>(y)[x]),
                 pt_curr,
                 epipolar_direction
             );
@@ -281,17 +340,32 @@ bool update(const Mat &ref, const Mat &curr, const SE3d &T_C_R, Mat &depth, Mat
                 continue;
 
             // 取消该注释以显示匹配
-            // showEpipolarMatch(ref, curr, Vector2d(x, y), pt_curr);
+            // showEpipolarMatch(ref_pyr[0].img, curr_pyr[0], Vector2d(x, y), pt_curr);
 
             // 匹配成功，更新深度图
             updateDepthFilter(Vector2d(x, y), pt_curr, T_C_R, epipolar_direction, depth, depth_cov2);
+            updated_local++;
         }
+        updated += updated_local;
+    }, double(num_seeds) / seeds_per_task);
+
+    // 去掉已收敛或发散的种子，剩下的保持原来的行优先顺序
+    seeds.erase(remove_if(seeds.begin(), seeds.end(), [&](const Point &p) {
+        float cov2 = depth_cov2.ptr<float>(p.y)[p.x];
+        return cov2 < min_cov || cov2 > max_cov;
+    }), seeds.end());
+
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+    double time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1).count();
+    cout << "updated " << updated << " of " << num_seeds << " active seeds in " << time_used * 1000 << " ms, "
+         << num_seeds / time_used << " seeds/s, " << seeds.size() << " seeds remain active" << endl;
+    return true;
 }
 
 // 极线搜索
 // 方法见书 12.2 12.3 两节
 bool epipolarSearch(
-    const Mat &ref, const Mat &curr,
+    const vector<RefImage> &ref_pyr, const vector<Mat> &curr_pyr,
     const SE3d &T_C_R, const Vector2d &pt_ref,
     const double &depth_mu, const double &depth_cov,
     Vector2d &pt_curr, Vector2d &epipolar_direction) {
@@ -312,59 +386,74 @@ bool epipolarSearch(
     if (half_length > 100) half_length = 100;   // 我们不希望搜索太多东西
 
     // 取消此句注释以显示极线（线段）
-    // showEpipolarLine( ref, curr, pt_ref, px_min_curr, px_max_curr );
-
-    // 在极线上搜索，以深度均值点为中心，左右各取半长度
-    double best_ncc = -1.0;
-    Vector2d best_px_curr;
-    for (double l = -half_length; l <= half_length; l += 0.7) { // l+=sqrt(2)
-        Vector2d px_curr = px_mean_curr + l * epipolar_direction;  // 待匹配点
-        if (!inside(px_curr))
-            continue;
-        // 计算待匹配点与参考帧的 NCC
-        double ncc = NCC(ref, curr, pt_ref, px_curr);
-        if (ncc > best_ncc) {
-            best_ncc = ncc;
-            best_px_curr = px_curr;
+    // showEpipolarLine( ref_pyr[0].img, curr_pyr[0], pt_ref, px_min_curr, px_max_curr );
+
+    // 极线越长，从越粗的层开始搜索；不确定度已经很小的像素直接在原图上搜
+    int start_level = 0;
+    while (start_level + 1 < int(curr_pyr.size()) &&
+           half_length * pow(0.5, start_level + 1) >= coarse_min_half_length)
+        start_level++;
+
+    // l 是沿极线到深度均值点的距离，始终以原图像素为单位
+    double l_min = -half_length, l_max = half_length;
+    double best_ncc = -1.0, best_l = 0;
+    for (int level = start_level; level >= 0; level--) {
+        const RefImage &ref = ref_pyr[level];
+        const Mat &curr = curr_pyr[level];
+        const double scale = pow(0.5, level);
+        const double step = 0.7 / scale;    // 每层都按该层的 0.7 像素步进
+
+        // 参考窗口只和 pt_ref 有关，每层搜索前取出一次并减去均值
+        float ref_patch[ncc_area];
+        const int x_ref = int((pt_ref(0, 0) + 0.5) * scale), y_ref = int((pt_ref(1, 0) + 0.5) * scale);
+        const float ref_mean = ref.mean.ptr<float>(y_ref)[x_ref], ref_norm = ref.norm.ptr<float>(y_ref)[x_ref];
+        for (int y = -ncc_window_size, k = 0; y <= ncc_window_size; y++)
+            for (int x = -ncc_window_size; x <= ncc_window_size; x++, k++)
+                ref_patch[k] = ref.img.ptr<uchar>(y_ref + y)[x_ref + x] - ref_mean;
+
+        // 在极线上搜索，粗层覆盖整段极线，细层只在上一层最优点附近
+        best_ncc = -1.0;
+        for (double l = l_min; l <= l_max; l += step) {
+            Vector2d px_curr = px_mean_curr + l * epipolar_direction;  // 待匹配点
+            if (!inside(px_curr))
+                continue;
+            // 计算待匹配点与参考帧的 NCC，坐标换算到这一层
+            Vector2d px_level = (px_curr + Vector2d(0.5, 0.5)) * scale - Vector2d(0.5, 0.5);
+            double ncc = NCC(ref_patch, ref_mean, ref_norm, curr, px_level);
+            if (ncc > best_ncc) {
+                best_ncc = ncc;
+                best_l = l;
+            }
         }
+        if (best_ncc == -1.0)   // 整段极线都在图像外
+            return false;
+        l_min = best_l - 2 * step;
+        l_max = best_l + 2 * step;
     }
     if (best_ncc < 0.85f)      // 只相信 NCC 很高的匹配
         return false;
-    pt_curr = best_px_curr;
+    pt_curr = px_mean_curr + best_l * epipolar_direction;
     return true;
 }
 
-double NCC(
-    const Mat &ref, const Mat &curr,
-    const Vector2d &pt_ref, const Vector2d &pt_curr) {
+float NCC(const float *ref_patch, float ref_mean, float ref_norm, const Mat &curr, const Vector2d &pt_curr) {
     // 零均值-归一化互相关
-    // 先算均值
-    double mean_ref = 0, mean_curr = 0;
-    vector<double> values_ref, values_curr; // 参考帧和当前帧的均值
-    for (int x = -ncc_window_size; x <= ncc_window_size; x++)
-        for (int y = -ncc_window_size; y <= ncc_window_size; y++) {
-            double value_ref = double(ref.ptr<uchar>(int(y + pt_ref(1, 0)))[int(x + pt_ref(0, 0))]) / 255.0;
-            mean_ref += value_ref;
-
-            double value_curr = getBilinearInterpolatedValue(curr, pt_curr + Vector2d(x, y));
-            mean_curr += value_curr;
-
-            values_ref.push_back(value_ref);
-            values_curr.push_back(value_curr);
-        }
-
-    mean_ref /= ncc_area;
-    mean_curr /= ncc_area;
-
-    // 计算 Zero mean NCC
-    double numerator = 0, demoniator1 = 0, demoniator2 = 0;
-    for (int i = 0; i < values_ref.size(); i++) {
-        double n = (values_ref[i] - mean_ref) * (values_curr[i] - mean_curr);
-        numerator += n;
-        demoniator1 += (values_ref[i] - mean_ref) * (values_ref[i] - mean_ref);
-        demoniator2 += (values_curr[i] - mean_curr) * (values_curr[i] - mean_curr);
+    // 参考窗口已经去过均值，因此分子就是它和当前窗口的内积，不需要当前窗口的均值；
+    // 当前窗口的和与平方和在同一遍循环里累加。当前值先减去参考均值，让 float 累加的数值小一些
+    const int size = 2 * ncc_window_size + 1;
+    float curr_patch[ncc_area];
+    slambook::sampleWindow(curr, pt_curr(0, 0) - ncc_window_size, pt_curr(1, 0) - ncc_window_size, size, size,
+                           curr_patch);
+
+    float dot = 0, sum = 0, sum2 = 0;
+    for (int k = 0; k < ncc_area; k++) {
+        float c = curr_patch[k] - ref_mean;
+        dot += ref_patch[k] * c;
+        sum += c;
+        sum2 += c * c;
     }
-    return numerator / sqrt(demoniator1 * demoniator2 + 1e-10);   // 防止分母出现零
+    float norm2_curr = max(0.0f, sum2 - sum * sum / ncc_area);
+    return dot / sqrt(ref_norm * ref_norm * norm2_curr + 1e-10f);   // 防止分母出现零
 }
 
 bool updateDepthFilter(
@@ -418,14 +507,14 @@ bool updateDepthFilter(
     double d_cov2 = d_cov * d_cov;
 
     // 高斯融合
-    double mu = depth.ptr<double>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))];
-    double sigma2 = depth_cov2.ptr<double>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))];
+    double mu = depth.ptr<float>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))];
+    double sigma2 = depth_cov2.ptr<float>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))];
 
     double mu_fuse = (d_cov2 * mu + sigma2 * depth_estimation) / (sigma2 + d_cov2);
     double sigma_fuse2 = (sigma2 * d_cov2) / (sigma2 + d_cov2);
 
-    depth.ptr<double>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))] = mu_fuse;
-    depth_cov2.ptr<double>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))] = sigma_fuse2;
+    depth.ptr<float>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))] = mu_fuse;
+    depth_cov2.ptr<float>(int(pt_ref(1, 0)))[int(pt_ref(0, 0))] = sigma_fuse2;
 
     return true;
 }
@@ -444,7 +533,7 @@ void evaludateDepth(const Mat &depth_truth, const Mat &depth_estimate) {
     int cnt_depth_data = 0;
     for (int y = boarder; y < depth_truth.rows - boarder; y++)
         for (int x = boarder; x < depth_truth.cols - boarder; x++) {
-            double error = depth_truth.ptr<double>(y)[x] - depth_estimate.ptr<double>(y)[x];
+            double error = depth_truth.ptr<float>(y)[x] - depth_estimate.ptr<float>(y)[x];
             ave_depth_error += error;
             ave_depth_error_sq += error * error;
             cnt_depth_data++;
@@ -28,6 +28,14 @@ class Config {
     static T Get(const std::string &key) {
         return T(Config::config_->file_[key]);
     }
+
+    // access an optional parameter, return default_value if it is missing
+    template <typename T>
+    static T Get(const std::string &key, const T &default_value) {
+        cv::FileNode node = Config::config_->file_[key];
+        if (node.empty()) return default_value;
+        return T(node);
+    }
 };
 }  // namespace myslam
 
@@ -3,6 +3,7 @@
 #include "myslam/camera.h"
 #include "myslam/common_include.h"
 #include "myslam/frame.h"
+#include "myslam/undistorter.h"
 
 namespace myslam {
 
@@ -23,16 +24,34 @@ class Dataset {
     /// create and return the next frame containing the stereo images
     Frame::Ptr NextFrame();
 
+    /// timestamp of the next frame without loading it, -1 if there is none
+    double PeekTimestamp() const;
+
+    /// skip the next frame without loading its images
+    void SkipFrame() { current_image_index_++; }
+
     /// get camera by id
     Camera::Ptr GetCamera(int camera_id) const {
         return cameras_.at(camera_id);
     }
 
    private:
+    /// build the lookup tables once the raw image size is known
+    void CreateUndistorters(const cv::Size &raw_size);
+
     std::string dataset_path_;
     int current_image_index_ = 0;
 
+    std::vector<double> timestamps_;  // from times.txt, may be empty
+    double frame_interval_ = 0.1;     // used when there is no times.txt
+
     std::vector<Camera::Ptr> cameras_;
+
+    // undistortion of raw (not rectified) sequences
+    bool undistort_ = false;
+    std::vector<Mat33> K_raw_;  // full resolution intrinsics of camera 0, 1
+    std::vector<Vec4, Eigen::aligned_allocator<Vec4>> distortion_;
+    std::vector<Undistorter::Ptr> undistorters_;
 };
 }  // namespace myslam
 
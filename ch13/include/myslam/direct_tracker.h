@@ -0,0 +1,68 @@
+#pragma once
+#ifndef MYSLAM_DIRECT_TRACKER_H
+#define MYSLAM_DIRECT_TRACKER_H
+
+#include "myslam/camera.h"
+#include "myslam/common_include.h"
+
+#include "image_pyramid.h"
+
+namespace myslam {
+
+typedef std::vector<Vec2, Eigen::aligned_allocator<Vec2>> VecVec2;
+
+/**
+ * 稀疏直接法位姿估计
+ * 将参考帧上的路标小块投影到当前帧，最小化光度误差求解 T_cur_ref
+ * 与第八章的 DirectPoseEstimationMultiLayer 相同，使用金字塔由粗到精，
+ * 金字塔和窗口采样用 common 下与第八章共用的 ImagePyramid 和 sampleWindow
+ */
+class DirectTracker {
+   public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+    typedef std::shared_ptr<DirectTracker> Ptr;
+
+    DirectTracker(Camera::Ptr camera)
+        : camera_(camera), pyramid_cache_(pyramids_) {}
+
+    /// set the reference image, its pyramid is cached with the current one
+    void SetReference(const cv::Mat &img_ref) { img_ref_ = img_ref; }
+
+    /**
+     * estimate the pose of current image w.r.t. the reference image
+     * @param img_cur       current image
+     * @param px_ref        pixels of the points in reference image
+     * @param pts_ref       3D points in the reference camera frame
+     * @param T_cur_ref     [in|out] initial guess and result
+     * @return num of points whose photometric error is small at the finest level
+     */
+    int Track(const cv::Mat &img_cur, const VecVec2 &px_ref,
+              const std::vector<Vec3> &pts_ref, SE3 &T_cur_ref);
+
+   private:
+    /**
+     * Gauss-Newton on one pyramid level, return num of good points
+     * @param scale         scale of this level w.r.t. the original image
+     * @param border        width of the replicated border around the levels
+     */
+    int TrackSingleLevel(const cv::Mat &img_ref, const cv::Mat &img_cur,
+                         double scale, int border, const VecVec2 &px_ref,
+                         const std::vector<Vec3> &pts_ref, SE3 &T_cur_ref);
+
+    // params
+    int pyramids_ = 3;  // each level is half the size of the previous one
+    int half_patch_size_ = 2;
+    int iterations_ = 10;
+    double huber_threshold_ = 20;
+    double inlier_threshold_ = 25 * 25;  // mean squared patch error
+
+    Camera::Ptr camera_ = nullptr;
+    cv::Mat img_ref_;
+    // pyramids of the reference and the current image; the current image
+    // usually becomes the next reference, so its pyramid is reused
+    slambook::PyramidCache pyramid_cache_;
+};
+
+}  // namespace myslam
+
+#endif  // MYSLAM_DIRECT_TRACKER_H
@@ -5,6 +5,7 @@
 
 #include "myslam/camera.h"
 #include "myslam/common_include.h"
+#include "myslam/seqlock.h"
 
 namespace myslam {
 
@@ -24,10 +25,12 @@ struct Frame {
     unsigned long id_ = 0;           // id of this frame
     unsigned long keyframe_id_ = 0;  // id of key frame
     bool is_keyframe_ = false;       // 是否为关键帧
-    double time_stamp_;              // 时间戳，暂不使用
-    SE3 pose_;                       // Tcw 形式Pose
-    std::mutex pose_mutex_;          // Pose数据锁
+    double time_stamp_ = 0;          // 时间戳，单位秒
+    SeqLock<SE3> pose_;              // Tcw 形式Pose，读取无锁
     cv::Mat left_img_, right_img_;   // stereo images
+    // PNG-compressed left image, kept for inactive keyframes after the raw
+    // images are released
+    std::vector<uchar> left_img_compressed_;
 
     // extracted features in left image
     std::vector<std::shared_ptr<Feature>> features_left_;
@@ -40,20 +43,30 @@ struct Frame {
     Frame(long id, double time_stamp, const SE3 &pose, const Mat &left,
           const Mat &right);
 
-    // set and get pose, thread safe
-    SE3 Pose() {
-        std::unique_lock<std::mutex> lck(pose_mutex_);
-        return pose_;
-    }
+    // set and get pose, thread safe and lock-free for readers
+    SE3 Pose() const { return pose_.Load(); }
 
-    void SetPose(const SE3 &pose) {
-        std::unique_lock<std::mutex> lck(pose_mutex_);
-        pose_ = pose;
-    }
+    void SetPose(const SE3 &pose) { pose_.Store(pose); }
 
     /// 设置关键帧并分配并键帧id
     void SetKeyFrame();
 
+    /**
+     * Release what is not needed once the keyframe leaves the active window:
+     * the right image and the right features. The left image is kept
+     * PNG-compressed for loop closure/relocalization
+     */
+    void ReleaseForInactive();
+
+    /// drop the compressed left image as well, keep only pose and features
+    void DropCompressedImage();
+
+    /// left image, decoded from the compressed copy if necessary
+    cv::Mat LeftImage() const;
+
+    /// approximate memory held by images and features, in bytes
+    size_t MemoryUsage() const;
+
     /// 工厂构建模式，分配id 
     static std::shared_ptr<Frame> CreateFrame();
 };
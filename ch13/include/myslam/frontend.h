@@ -5,6 +5,7 @@
 #include <opencv2/features2d.hpp>
 
 #include "myslam/common_include.h"
+#include "myslam/direct_tracker.h"
 #include "myslam/frame.h"
 #include "myslam/map.h"
 
@@ -15,6 +16,9 @@ class Viewer;
 
 enum class FrontendStatus { INITING, TRACKING_GOOD, TRACKING_BAD, LOST };
 
+/// LK: 每帧光流跟踪特征点; SEMI_DIRECT: 普通帧用直接法，仅关键帧跟踪特征点
+enum class FrontendMode { LK, SEMI_DIRECT };
+
 /**
  * 前端
  * 估计当前帧Pose，在满足关键帧条件时向地图加入关键帧并触发优化
@@ -41,6 +45,7 @@ class Frontend {
     void SetCameras(Camera::Ptr left, Camera::Ptr right) {
         camera_left_ = left;
         camera_right_ = right;
+        direct_tracker_ = DirectTracker::Ptr(new DirectTracker(left));
     }
 
    private:
@@ -57,11 +62,29 @@ class Frontend {
     bool Reset();
 
     /**
-     * Track with last frame
+     * Track with last frame, or with the reference keyframe in semi-direct
+     * mode since the other frames have no features
      * @return num of tracked points
      */
     int TrackLastFrame();
 
+    /**
+     * Estimate current frame's pose by aligning the landmark patches of the
+     * reference keyframe with direct method
+     * @return num of landmarks with small photometric error
+     */
+    int TrackDirect();
+
+    /// use current frame as the reference keyframe of direct tracking
+    void SetDirectReference();
+
+    /**
+     * Predict the motion from last frame to current frame, scaled by the
+     * time between them so that dropped frames are accounted for
+     * @return relative motion T_current_last
+     */
+    SE3 PredictMotion();
+
     /**
      * estimate current frame's pose
      * @return num of inliers
@@ -70,9 +93,10 @@ class Frontend {
 
     /**
      * set current frame as a keyframe and insert it into backend
+     * @param force insert even if there are still enough tracked features
      * @return true if success
      */
-    bool InsertKeyframe();
+    bool InsertKeyframe(bool force = false);
 
     /**
      * Try init the frontend with stereo images saved in current_frame_
@@ -115,6 +139,7 @@ class Frontend {
 
     Frame::Ptr current_frame_ = nullptr;  // 当前帧
     Frame::Ptr last_frame_ = nullptr;     // 上一帧
+    Frame::Ptr reference_keyframe_ = nullptr;  // 直接法的参考关键帧
     Camera::Ptr camera_left_ = nullptr;   // 左侧相机
     Camera::Ptr camera_right_ = nullptr;  // 右侧相机
 
@@ -123,10 +148,12 @@ class Frontend {
     std::shared_ptr<Viewer> viewer_ = nullptr;
 
     SE3 relative_motion_;  // 当前帧与上一帧的相对运动，用于估计当前帧pose初值
+    double relative_motion_dt_ = 0;  // relative_motion_ 对应的时间间隔
 
     int tracking_inliers_ = 0;  // inliers, used for testing new keyframes
 
     // params
+    FrontendMode mode_ = FrontendMode::LK;
     int num_features_ = 200;
     int num_features_init_ = 100;
     int num_features_tracking_ = 50;
@@ -135,6 +162,7 @@ class Frontend {
 
     // utilities
     cv::Ptr<cv::GFTTDetector> gftt_;  // feature detector in opencv
+    DirectTracker::Ptr direct_tracker_ = nullptr;
 };
 
 }  // namespace myslam
@@ -52,10 +52,19 @@ class Map {
     /// 清理map中观测数量为零的点
     void CleanMap();
 
+    /// 设置不活跃关键帧压缩图像的内存上限，单位字节
+    void SetInactiveImageBudget(size_t bytes) { inactive_image_budget_ = bytes; }
+
+    /// 关键帧占用的内存（图像与特征），单位字节
+    size_t MemoryUsage();
+
    private:
     // 将旧的关键帧置为不活跃状态
     void RemoveOldKeyframe();
 
+    // 释放不活跃关键帧的图像和特征，使其满足内存上限
+    void ReleaseInactiveKeyframe(Frame::Ptr frame);
+
     std::mutex data_mutex_;
     LandmarksType landmarks_;         // all landmarks
     LandmarksType active_landmarks_;  // active landmarks
@@ -64,8 +73,14 @@ class Map {
 
     Frame::Ptr current_frame_ = nullptr;
 
+    // 仍保留压缩图像的不活跃关键帧，按失活顺序排列
+    std::list<Frame::Ptr> inactive_with_image_;
+    size_t inactive_image_bytes_ = 0;   // 上述关键帧的压缩图像大小
+    size_t inactive_memory_bytes_ = 0;  // 所有不活跃关键帧的内存
+
     // settings
     int num_active_keyframes_ = 3;  // 激活的关键帧数量
+    size_t inactive_image_budget_ = 256 << 20;  // 不活跃关键帧图像内存上限
 };
 }  // namespace myslam
 
@@ -3,6 +3,7 @@
 #define MYSLAM_MAPPOINT_H
 
 #include "myslam/common_include.h"
+#include "myslam/seqlock.h"
 
 namespace myslam {
 
@@ -20,8 +21,8 @@ struct MapPoint {
     typedef std::shared_ptr<MapPoint> Ptr;
     unsigned long id_ = 0;  // ID
     bool is_outlier_ = false;
-    Vec3 pos_ = Vec3::Zero();  // Position in world
-    std::mutex data_mutex_;
+    SeqLock<Vec3> pos_{Vec3::Zero()};  // Position in world, lock-free read
+    std::mutex data_mutex_;            // guards the observations
     int observed_times_ = 0;  // being observed by feature matching algo.
     std::list<std::weak_ptr<Feature>> observations_;
 
@@ -29,15 +30,9 @@ struct MapPoint {
 
     MapPoint(long id, Vec3 position);
 
-    Vec3 Pos() {
-        std::unique_lock<std::mutex> lck(data_mutex_);
-        return pos_;
-    }
+    Vec3 Pos() const { return pos_.Load(); }
 
-    void SetPos(const Vec3 &pos) {
-        std::unique_lock<std::mutex> lck(data_mutex_);
-        pos_ = pos;
-    };
+    void SetPos(const Vec3 &pos) { pos_.Store(pos); }
 
     void AddObservation(std::shared_ptr<Feature> feature) {
         std::unique_lock<std::mutex> lck(data_mutex_);
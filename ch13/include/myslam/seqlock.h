@@ -0,0 +1,90 @@
+#pragma once
+#ifndef MYSLAM_SEQLOCK_H
+#define MYSLAM_SEQLOCK_H
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <thread>
+
+namespace myslam {
+
+/**
+ * 顺序锁（seqlock）
+ * 读者不加锁、不阻塞，写者通过版本号互斥；版本号为奇数表示正在写入
+ * 用于 Frame 的 Pose 和 MapPoint 的位置这类读多写少的小数据
+ *
+ * T 需可按字节拷贝（Eigen/Sophus 的定长类型满足该要求）
+ */
+template <typename T>
+class SeqLock {
+   public:
+    SeqLock() : SeqLock(T()) {}
+
+    explicit SeqLock(const T &value) { Store(value); }
+
+    SeqLock(const SeqLock &) = delete;
+    SeqLock &operator=(const SeqLock &) = delete;
+
+    /// read a consistent copy of the value, never blocks the writer
+    T Load() const {
+        std::uint64_t buffer[kWords];
+        std::uint64_t seq_begin = 0, seq_end = 0;
+        do {
+            seq_begin = seq_.load(std::memory_order_acquire);
+            while (seq_begin & 1) {
+                // a writer is in progress
+                std::this_thread::yield();
+                seq_begin = seq_.load(std::memory_order_acquire);
+            }
+            for (int i = 0; i < kWords; ++i) {
+                buffer[i] = data_[i].load(std::memory_order_relaxed);
+            }
+            std::atomic_thread_fence(std::memory_order_acquire);
+            seq_end = seq_.load(std::memory_order_relaxed);
+        } while (seq_begin != seq_end);
+
+        T value;
+        std::memcpy(static_cast<void *>(&value), buffer, sizeof(T));
+        return value;
+    }
+
+    /// write a new value, concurrent writers are serialized by the sequence
+    void Store(const T &value) {
+        std::uint64_t buffer[kWords] = {0};
+        std::memcpy(buffer, static_cast<const void *>(&value), sizeof(T));
+
+        std::uint64_t seq = seq_.load(std::memory_order_relaxed);
+        while (true) {
+            if ((seq & 1) == 0 &&
+                seq_.compare_exchange_weak(seq, seq + 1,
+                                           std::memory_order_acquire,
+                                           std::memory_order_relaxed)) {
+                break;
+            }
+            std::this_thread::yield();
+            seq = seq_.load(std::memory_order_relaxed);
+        }
+        std::atomic_thread_fence(std::memory_order_release);
+        for (int i = 0; i < kWords; ++i) {
+            data_[i].store(buffer[i], std::memory_order_relaxed);
+        }
+        seq_.store(seq + 2, std::memory_order_release);
+    }
+
+    /// number of completed writes, can be used to detect changes cheaply
+    std::uint64_t Version() const {
+        return seq_.load(std::memory_order_acquire) >> 1;
+    }
+
+   private:
+    static constexpr int kWords =
+        (sizeof(T) + sizeof(std::uint64_t) - 1) / sizeof(std::uint64_t);
+
+    std::atomic<std::uint64_t> seq_{0};
+    std::atomic<std::uint64_t> data_[kWords];
+};
+
+}  // namespace myslam
+
+#endif  // MYSLAM_SEQLOCK_H
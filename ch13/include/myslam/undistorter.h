@@ -0,0 +1,52 @@
+#pragma once
+#ifndef MYSLAM_UNDISTORTER_H
+#define MYSLAM_UNDISTORTER_H
+
+#include "myslam/common_include.h"
+
+namespace myslam {
+
+/**
+ * 查找表去畸变
+ * 构造时对每个输出像素计算一次畸变模型，记录源图像中左上邻居的偏移和
+ * 7 位定点的双线性权重；之后每帧只需查表插值，按行并行，支持 AVX2
+ * 同时可以完成缩放（输出内参与原始内参不同）和立体校正（旋转 R）
+ */
+class Undistorter {
+   public:
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW;
+    typedef std::shared_ptr<Undistorter> Ptr;
+
+    /**
+     * build the lookup table
+     * @param K_src     intrinsics of the raw image
+     * @param dist      radial-tangential distortion k1, k2, p1, p2
+     * @param src_size  size of the raw image
+     * @param K_dst     intrinsics of the output image
+     * @param dst_size  size of the output image
+     * @param R         rotation from the output camera to the raw camera,
+     *                  identity if we only undistort
+     */
+    Undistorter(const Mat33 &K_src, const Vec4 &dist, const cv::Size &src_size,
+                const Mat33 &K_dst, const cv::Size &dst_size,
+                const Mat33 &R = Mat33::Identity());
+
+    /// undistort a CV_8UC1 image of src_size into dst
+    void Apply(const cv::Mat &src, cv::Mat &dst) const;
+
+    /**
+     * interpolate the output rows [row_begin, row_end) with the table
+     * src must be continuous, with src_size_.width bytes per row
+     */
+    void ApplyRows(const uchar *src, uchar *dst, size_t dst_step,
+                   int row_begin, int row_end) const;
+
+   private:
+    cv::Size src_size_, dst_size_;
+    std::vector<int32_t> offsets_;   // offset of top-left neighbour, -1 if outside
+    std::vector<uint16_t> weights_;  // fx | fy << 8, in [0, 128]
+};
+
+}  // namespace myslam
+
+#endif  // MYSLAM_UNDISTORTER_H
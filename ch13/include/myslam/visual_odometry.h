@@ -29,6 +29,8 @@ class VisualOdometry {
 
     /**
      * start vo in the dataset
+     * if realtime is set in config, frames are replayed on their timestamps
+     * and stale frames are dropped, see RunRealtime()
      */
     void Run();
 
@@ -41,9 +43,26 @@ class VisualOdometry {
     FrontendStatus GetFrontendStatus() const { return frontend_->GetStatus(); }
 
    private:
+    /**
+     * replay the dataset on the camera clock and drop the frames whose
+     * latency already exceeds latency_budget_ when we get to them
+     */
+    void RunRealtime();
+
     bool inited_ = false;
     std::string config_file_path_;
 
+    // real-time mode
+    bool realtime_ = false;
+    double latency_budget_ = 0.1;  // seconds from frame arrival
+    double playback_speed_ = 1.0;
+
+    // statistics
+    int num_frames_processed_ = 0;
+    int num_frames_dropped_ = 0;
+    int num_deadline_misses_ = 0;
+    double total_latency_ = 0, max_latency_ = 0;
+
     Frontend::Ptr frontend_ = nullptr;
     Backend::Ptr backend_ = nullptr;
     Map::Ptr map_ = nullptr;
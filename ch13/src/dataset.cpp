@@ -1,5 +1,7 @@
 #include "myslam/dataset.h"
+#include "myslam/config.h"
 #include "myslam/frame.h"
+#include "myslam/undistorter.h"
 
 #include <boost/format.hpp>
 #include <fstream>
@@ -35,6 +37,7 @@ bool Dataset::Init() {
         Vec3 t;
         t << projection_data[3], projection_data[7], projection_data[11];
         t = K.inverse() * t;
+        if (i < 2) K_raw_.push_back(K);
         K = K * 0.5; // rescale image to half size
         Camera::Ptr new_camera(new Camera(K(0, 0), K(1, 1), K(0, 2), K(1, 2),
                                           t.norm(), SE3(SO3(), t)));
@@ -42,10 +45,45 @@ bool Dataset::Init() {
         LOG(INFO) << "Camera " << i << " extrinsics: " << t.transpose();
     }
     fin.close();
+
+    // distortion of the two raw images, only used if undistort is set
+    undistort_ = Config::Get<int>("undistort", 0) != 0;
+    distortion_.clear();
+    undistorters_.clear();
+    for (int i = 0; i < 2 && undistort_; ++i) {
+        std::string prefix = "camera_" + std::to_string(i) + ".";
+        distortion_.push_back(Vec4(Config::Get<double>(prefix + "k1", 0.0),
+                                   Config::Get<double>(prefix + "k2", 0.0),
+                                   Config::Get<double>(prefix + "p1", 0.0),
+                                   Config::Get<double>(prefix + "p2", 0.0)));
+        LOG(INFO) << "Camera " << i
+                  << " distortion: " << distortion_.back().transpose();
+    }
+
+    // read the timestamps, fall back to a fixed camera rate if not given
+    timestamps_.clear();
+    ifstream fin_times(dataset_path_ + "/times.txt");
+    double timestamp = 0;
+    while (fin_times >> timestamp) {
+        timestamps_.push_back(timestamp);
+    }
+    frame_interval_ = 1.0 / Config::Get<double>("camera_rate", 10.0);
+    LOG(INFO) << "Loaded " << timestamps_.size() << " timestamps";
+
     current_image_index_ = 0;
     return true;
 }
 
+double Dataset::PeekTimestamp() const {
+    if (timestamps_.empty()) {
+        return current_image_index_ * frame_interval_;
+    }
+    if (current_image_index_ >= int(timestamps_.size())) {
+        return -1;
+    }
+    return timestamps_[current_image_index_];
+}
+
 Frame::Ptr Dataset::NextFrame() {
     boost::format fmt("%s/image_%d/%06d.png");
     cv::Mat image_left, image_right;
@@ -64,16 +102,39 @@ Frame::Ptr Dataset::NextFrame() {
 
      // rescale image to half size
     cv::Mat image_left_resized, image_right_resized;
-    cv::resize(image_left, image_left_resized, cv::Size(), 0.5, 0.5,
-               cv::INTER_NEAREST);
-    cv::resize(image_right, image_right_resized, cv::Size(), 0.5, 0.5,
-               cv::INTER_NEAREST);
+    if (undistort_) {
+        // the lookup tables undistort and downsample in one pass
+        if (undistorters_.empty()) {
+            CreateUndistorters(image_left.size());
+        }
+        undistorters_[0]->Apply(image_left, image_left_resized);
+        undistorters_[1]->Apply(image_right, image_right_resized);
+    } else {
+        cv::resize(image_left, image_left_resized, cv::Size(), 0.5, 0.5,
+                   cv::INTER_NEAREST);
+        cv::resize(image_right, image_right_resized, cv::Size(), 0.5, 0.5,
+                   cv::INTER_NEAREST);
+    }
 
     auto new_frame = Frame::CreateFrame();
+    new_frame->time_stamp_ = PeekTimestamp();
     new_frame->left_img_ = image_left_resized;
     new_frame->right_img_ = image_right_resized;
     current_image_index_++;
     return new_frame;
 }
 
+void Dataset::CreateUndistorters(const cv::Size &raw_size) {
+    cv::Size half_size(cvRound(raw_size.width * 0.5),
+                       cvRound(raw_size.height * 0.5));
+    for (int i = 0; i < 2; ++i) {
+        Mat33 K_half = K_raw_[i] * 0.5;
+        K_half(2, 2) = 1;
+        undistorters_.push_back(Undistorter::Ptr(new Undistorter(
+            K_raw_[i], distortion_[i], raw_size, K_half, half_size)));
+    }
+    LOG(INFO) << "Built undistortion tables for " << raw_size.width << "x"
+              << raw_size.height << " images";
+}
+
 }  // namespace myslam
\ No newline at end of file
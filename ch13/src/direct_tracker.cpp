@@ -0,0 +1,168 @@
+#include "myslam/direct_tracker.h"
+
+#include <opencv2/opencv.hpp>
+
+#include "image_sampling.h"
+
+namespace myslam {
+
+typedef Eigen::Matrix<double, 2, 6> Mat26;
+
+namespace {
+
+/// partial sums of one chunk of points
+struct ChunkSums {
+    Mat66 H = Mat66::Zero();  // only the upper triangle is accumulated
+    Vec6 b = Vec6::Zero();
+    double cost = 0;
+    int cnt_good = 0;
+    EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+};
+
+}  // namespace
+
+int DirectTracker::Track(const cv::Mat &img_cur, const VecVec2 &px_ref,
+                         const std::vector<Vec3> &pts_ref, SE3 &T_cur_ref) {
+    if (img_ref_.empty() || px_ref.empty()) return 0;
+    // the cache holds two pyramids, getting the current one keeps the
+    // reference that was just used
+    const slambook::ImagePyramid &pyr_ref = pyramid_cache_.get(img_ref_);
+    const slambook::ImagePyramid &pyr_cur = pyramid_cache_.get(img_cur);
+
+    int num_good = 0;
+    for (int level = pyramids_ - 1; level >= 0; level--) {
+        num_good = TrackSingleLevel(pyr_ref[level], pyr_cur[level],
+                                    1.0 / (1 << level), pyr_ref.borderWidth(),
+                                    px_ref, pts_ref, T_cur_ref);
+    }
+    return num_good;
+}
+
+int DirectTracker::TrackSingleLevel(const cv::Mat &img_ref,
+                                    const cv::Mat &img_cur, double scale,
+                                    int border, const VecVec2 &px_ref,
+                                    const std::vector<Vec3> &pts_ref,
+                                    SE3 &T_cur_ref) {
+    const double fx = camera_->fx_ * scale, fy = camera_->fy_ * scale,
+                 cx = camera_->cx_ * scale, cy = camera_->cy_ * scale;
+    const int half = half_patch_size_;
+    const int size = 2 * half, area = size * size;
+    const int window_size = size + 2;  // one pixel more for the gradient
+    const int num_points = px_ref.size();
+
+    // the reference patches do not change with the pose, extract them once
+    std::vector<float> patches_ref(num_points * area);
+    cv::parallel_for_(cv::Range(0, num_points), [&](const cv::Range &range) {
+        for (int i = range.start; i < range.end; i++) {
+            Vec2 px = px_ref[i] * scale;
+            slambook::sampleWindow(img_ref, px[0] - half, px[1] - half, size,
+                                   size, &patches_ref[i * area], border);
+        }
+    });
+
+    // fixed chunks, independent of the number of threads, summed in order
+    const int chunk_size = 64;
+    const int chunks = (num_points + chunk_size - 1) / chunk_size;
+
+    // mean squared error of each point, -1 if not visible
+    std::vector<double> point_errors(num_points, -1);
+    std::vector<double> accepted_errors(num_points, -1);
+    SE3 T = T_cur_ref;
+    double last_cost = 0;
+    for (int iter = 0; iter < iterations_; iter++) {
+        std::vector<ChunkSums, Eigen::aligned_allocator<ChunkSums>> partial(
+            chunks);
+        cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range) {
+            std::vector<float> window(window_size * window_size), curr(area),
+                grad_x(area), grad_y(area);
+            for (int c = range.start; c < range.end; c++) {
+                ChunkSums &sums = partial[c];
+                const int end = std::min(num_points, (c + 1) * chunk_size);
+                for (int i = c * chunk_size; i < end; i++) {
+                    point_errors[i] = -1;
+                    Vec3 pc = T * pts_ref[i];
+                    if (pc[2] < 1e-3) continue;  // depth invalid
+                    double u = fx * pc[0] / pc[2] + cx,
+                           v = fy * pc[1] / pc[2] + cy;
+                    if (u < half + 1 || u > img_cur.cols - half - 2 ||
+                        v < half + 1 || v > img_cur.rows - half - 2)
+                        continue;
+
+                    double X = pc[0], Y = pc[1], Z_inv = 1.0 / pc[2],
+                           Z2_inv = Z_inv * Z_inv;
+                    Mat26 J_pixel_xi;
+                    J_pixel_xi << fx * Z_inv, 0, -fx * X * Z2_inv,
+                        -fx * X * Y * Z2_inv, fx + fx * X * X * Z2_inv,
+                        -fx * Y * Z_inv, 0, fy * Z_inv, -fy * Y * Z2_inv,
+                        -fy - fy * Y * Y * Z2_inv, fy * X * Y * Z2_inv,
+                        fy * X * Z_inv;
+
+                    // the current patch with a one pixel border, then its
+                    // central difference gradient
+                    slambook::sampleWindow(img_cur, u - half - 1, v - half - 1,
+                                           window_size, window_size,
+                                           window.data(), border);
+                    slambook::windowGradient(window.data(), window_size,
+                                             window_size, curr.data(),
+                                             grad_x.data(), grad_y.data());
+
+                    const float *patch = &patches_ref[i * area];
+                    double error_sum = 0;
+                    for (int k = 0; k < area; k++) {
+                        double error = patch[k] - curr[k];
+                        Vec6 J = -(grad_x[k] * J_pixel_xi.row(0) +
+                                   grad_y[k] * J_pixel_xi.row(1))
+                                      .transpose();
+                        double hw = std::abs(error) < huber_threshold_
+                                        ? 1
+                                        : huber_threshold_ / std::abs(error);
+                        sums.H.selfadjointView<Eigen::Upper>().rankUpdate(J,
+                                                                          hw);
+                        sums.b += -hw * error * J;
+                        sums.cost += hw * error * error;
+                        error_sum += error * error;
+                    }
+                    point_errors[i] = error_sum / area;
+                    sums.cnt_good++;
+                }
+            }
+        });
+
+        Mat66 H = Mat66::Zero();
+        Vec6 b = Vec6::Zero();
+        double cost = 0;
+        int cnt_good = 0;
+        for (auto &sums : partial) {
+            H += sums.H;
+            b += sums.b;
+            cost += sums.cost;
+            cnt_good += sums.cnt_good;
+        }
+        H.triangularView<Eigen::StrictlyLower>() = H.transpose();
+
+        if (cnt_good == 0) return 0;
+        cost /= cnt_good;
+        if (iter > 0 && cost > last_cost) {
+            // the last update made it worse, keep the previous estimation
+            break;
+        }
+        // T_cur_ref only ever holds a pose whose errors have been evaluated,
+        // so the inliers below are counted for the pose that is returned
+        T_cur_ref = T;
+        accepted_errors = point_errors;
+
+        Vec6 update = H.ldlt().solve(b);
+        if (std::isnan(update[0])) break;
+        if (update.norm() < 1e-3) break;  // converged, the remaining step is negligible
+        T = SE3::exp(update) * T;
+        last_cost = cost;
+    }
+
+    int num_good = 0;
+    for (auto &e : accepted_errors) {
+        if (e >= 0 && e < inlier_threshold_) num_good++;
+    }
+    return num_good;
+}
+
+}  // namespace myslam
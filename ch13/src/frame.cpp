@@ -18,6 +18,9 @@
  */
 
 #include "myslam/frame.h"
+#include "myslam/feature.h"
+
+#include <opencv2/imgcodecs.hpp>
 
 namespace myslam {
 
@@ -37,4 +40,39 @@ void Frame::SetKeyFrame() {
     keyframe_id_ = keyframe_factory_id++;
 }
 
+void Frame::ReleaseForInactive() {
+    if (!left_img_.empty()) {
+        cv::imencode(".png", left_img_, left_img_compressed_);
+        left_img_compressed_.shrink_to_fit();
+    }
+    left_img_.release();
+    right_img_.release();
+
+    features_left_.shrink_to_fit();
+    std::vector<std::shared_ptr<Feature>>().swap(features_right_);
+}
+
+void Frame::DropCompressedImage() {
+    std::vector<uchar>().swap(left_img_compressed_);
+}
+
+cv::Mat Frame::LeftImage() const {
+    if (!left_img_.empty() || left_img_compressed_.empty()) return left_img_;
+    return cv::imdecode(left_img_compressed_, cv::IMREAD_GRAYSCALE);
+}
+
+size_t Frame::MemoryUsage() const {
+    size_t bytes = left_img_.total() * left_img_.elemSize() +
+                   right_img_.total() * right_img_.elemSize() +
+                   left_img_compressed_.capacity();
+    size_t num_features = features_left_.size();
+    for (auto &feat : features_right_) {
+        if (feat) num_features++;
+    }
+    bytes += num_features * sizeof(Feature) +
+             (features_left_.capacity() + features_right_.capacity()) *
+                 sizeof(std::shared_ptr<Feature>);
+    return bytes;
+}
+
 }
@@ -20,6 +20,9 @@ Frontend::Frontend() {
         cv::GFTTDetector::create(Config::Get<int>("num_features"), 0.01, 20);
     num_features_init_ = Config::Get<int>("num_features_init");
     num_features_ = Config::Get<int>("num_features");
+    if (Config::Get<std::string>("frontend_mode", "lk") == "semi_direct") {
+        mode_ = FrontendMode::SEMI_DIRECT;
+    }
 }
 
 bool Frontend::AddFrame(myslam::Frame::Ptr frame) {
@@ -46,11 +49,22 @@ bool Frontend::AddFrame(myslam::Frame::Ptr frame) {
 
 bool Frontend::Track() {
     if (last_frame_) {
-        current_frame_->SetPose(relative_motion_ * last_frame_->Pose());
+        current_frame_->SetPose(PredictMotion() * last_frame_->Pose());
     }
 
-    int num_track_last = TrackLastFrame();
-    tracking_inliers_ = EstimateCurrentPose();
+    // in semi-direct mode, only fall back to feature tracking and insert a
+    // keyframe when the direct method cannot see enough landmarks
+    bool tracked_directly = false;
+    if (mode_ == FrontendMode::SEMI_DIRECT && reference_keyframe_) {
+        tracking_inliers_ = TrackDirect();
+        tracked_directly =
+            tracking_inliers_ >= num_features_needed_for_keyframe_;
+    }
+
+    if (!tracked_directly) {
+        int num_track_last = TrackLastFrame();
+        tracking_inliers_ = EstimateCurrentPose();
+    }
 
     if (tracking_inliers_ > num_features_tracking_) {
         // tracking good
@@ -63,15 +77,29 @@ bool Frontend::Track() {
         status_ = FrontendStatus::LOST;
     }
 
-    InsertKeyframe();
+    if (!tracked_directly) {
+        InsertKeyframe(mode_ == FrontendMode::SEMI_DIRECT);
+    }
     relative_motion_ = current_frame_->Pose() * last_frame_->Pose().inverse();
+    relative_motion_dt_ =
+        current_frame_->time_stamp_ - last_frame_->time_stamp_;
 
     if (viewer_) viewer_->AddCurrentFrame(current_frame_);
     return true;
 }
 
-bool Frontend::InsertKeyframe() {
-    if (tracking_inliers_ >= num_features_needed_for_keyframe_) {
+SE3 Frontend::PredictMotion() {
+    double dt = current_frame_->time_stamp_ - last_frame_->time_stamp_;
+    if (relative_motion_dt_ <= 0 || dt <= 0 ||
+        std::abs(dt - relative_motion_dt_) < 1e-6) {
+        return relative_motion_;
+    }
+    // frames were dropped or arrive irregularly, assume constant velocity
+    return SE3::exp(relative_motion_.log() * (dt / relative_motion_dt_));
+}
+
+bool Frontend::InsertKeyframe(bool force) {
+    if (!force && tracking_inliers_ >= num_features_needed_for_keyframe_) {
         // still have enough features, don't insert keyframe
         return false;
     }
@@ -89,6 +117,7 @@ bool Frontend::InsertKeyframe() {
     FindFeaturesInRight();
     // triangulate map points
     TriangulateNewPoints();
+    if (mode_ == FrontendMode::SEMI_DIRECT) SetDirectReference();
     // update backend because we have a new keyframe
     backend_->UpdateMap();
 
@@ -170,7 +199,7 @@ int Frontend::EstimateCurrentPose() {
         if (mp) {
             features.push_back(current_frame_->features_left_[i]);
             EdgeProjectionPoseOnly *edge =
-                new EdgeProjectionPoseOnly(mp->pos_, K);
+                new EdgeProjectionPoseOnly(mp->Pos(), K);
             edge->setId(index);
             edge->setVertex(0, vertex_pose);
             edge->setMeasurement(
@@ -229,15 +258,50 @@ int Frontend::EstimateCurrentPose() {
     return features.size() - cnt_outlier;
 }
 
+int Frontend::TrackDirect() {
+    VecVec2 px_ref;
+    std::vector<Vec3> pts_ref;
+    SE3 T_ref = reference_keyframe_->Pose();
+    for (auto &feat : reference_keyframe_->features_left_) {
+        auto mp = feat->map_point_.lock();
+        if (mp == nullptr) continue;
+        px_ref.push_back(toVec2(feat->position_.pt));
+        pts_ref.push_back(camera_left_->world2camera(mp->Pos(), T_ref));
+    }
+
+    // the direct method works with the poses of the left camera
+    SE3 T_cur_ref = camera_left_->pose() * current_frame_->Pose() *
+                    T_ref.inverse() * camera_left_->pose_inv_;
+    int num_good = direct_tracker_->Track(current_frame_->left_img_, px_ref,
+                                          pts_ref, T_cur_ref);
+    current_frame_->SetPose(camera_left_->pose_inv_ * T_cur_ref *
+                            camera_left_->pose() * T_ref);
+
+    LOG(INFO) << "Direct tracking: " << num_good << "/" << px_ref.size()
+              << " landmarks";
+    return num_good;
+}
+
+void Frontend::SetDirectReference() {
+    reference_keyframe_ = current_frame_;
+    direct_tracker_->SetReference(current_frame_->left_img_);
+}
+
 int Frontend::TrackLastFrame() {
+    // in semi-direct mode only the keyframes have features
+    Frame::Ptr last_frame = last_frame_;
+    if (mode_ == FrontendMode::SEMI_DIRECT && reference_keyframe_) {
+        last_frame = reference_keyframe_;
+    }
+
     // use LK flow to estimate points in the last image
     std::vector<cv::Point2f> kps_last, kps_current;
-    for (auto &kp : last_frame_->features_left_) {
+    SE3 current_pose = current_frame_->Pose();
+    for (auto &kp : last_frame->features_left_) {
         if (kp->map_point_.lock()) {
             // use project point
             auto mp = kp->map_point_.lock();
-            auto px =
-                camera_left_->world2pixel(mp->pos_, current_frame_->Pose());
+            auto px = camera_left_->world2pixel(mp->Pos(), current_pose);
             kps_last.push_back(kp->position_.pt);
             kps_current.push_back(cv::Point2f(px[0], px[1]));
         } else {
@@ -249,7 +313,7 @@ int Frontend::TrackLastFrame() {
     std::vector<uchar> status;
     Mat error;
     cv::calcOpticalFlowPyrLK(
-        last_frame_->left_img_, current_frame_->left_img_, kps_last,
+        last_frame->left_img_, current_frame_->left_img_, kps_last,
         kps_current, status, error, cv::Size(11, 11), 3,
         cv::TermCriteria(cv::TermCriteria::COUNT + cv::TermCriteria::EPS, 30,
                          0.01),
@@ -261,7 +325,7 @@ int Frontend::TrackLastFrame() {
         if (status[i]) {
             cv::KeyPoint kp(kps_current[i], 7);
             Feature::Ptr feature(new Feature(current_frame_, kp));
-            feature->map_point_ = last_frame_->features_left_[i]->map_point_;
+            feature->map_point_ = last_frame->features_left_[i]->map_point_;
             current_frame_->features_left_.push_back(feature);
             num_good_pts++;
         }
@@ -313,13 +377,13 @@ int Frontend::DetectFeatures() {
 int Frontend::FindFeaturesInRight() {
     // use LK flow to estimate points in the right image
     std::vector<cv::Point2f> kps_left, kps_right;
+    SE3 current_pose = current_frame_->Pose();
     for (auto &kp : current_frame_->features_left_) {
         kps_left.push_back(kp->position_.pt);
         auto mp = kp->map_point_.lock(); // get kp's corresponding map point
         if (mp) {
             // use projected points as initial guess
-            auto px =
-                camera_right_->world2pixel(mp->pos_, current_frame_->Pose());
+            auto px = camera_right_->world2pixel(mp->Pos(), current_pose);
             kps_right.push_back(cv::Point2f(px[0], px[1]));
         } else {
             // use same pixel in left iamge
@@ -380,6 +444,7 @@ bool Frontend::BuildInitMap() {
     }
     current_frame_->SetKeyFrame();
     map_->InsertKeyFrame(current_frame_);
+    if (mode_ == FrontendMode::SEMI_DIRECT) SetDirectReference();
     backend_->UpdateMap();
 
     LOG(INFO) << "Initial map created with " << cnt_init_landmarks
@@ -79,10 +79,15 @@ void Map::RemoveOldKeyframe() {
     LOG(INFO) << "remove keyframe " << frame_to_remove->keyframe_id_;
     // remove keyframe and landmark observation
     active_keyframes_.erase(frame_to_remove->keyframe_id_);
+    std::vector<std::shared_ptr<Feature>> features_with_landmark;
     for (auto feat : frame_to_remove->features_left_) {
         auto mp = feat->map_point_.lock();
         if (mp) { // if this feature has corresponding mappoint
+            features_with_landmark.push_back(feat);
             mp->RemoveObservation(feat);
+            // RemoveObservation also clears the feature's link; the landmark no longer
+            // counts this observation, but the kept feature still points to it
+            feat->map_point_ = mp;
         }
     }
     for (auto feat : frame_to_remove->features_right_) {
@@ -94,6 +99,42 @@ void Map::RemoveOldKeyframe() {
     }
 
     CleanMap();
+
+    // the left features of former landmarks are kept for relocalization
+    frame_to_remove->features_left_.swap(features_with_landmark);
+    ReleaseInactiveKeyframe(frame_to_remove);
+}
+
+void Map::ReleaseInactiveKeyframe(Frame::Ptr frame) {
+    frame->ReleaseForInactive();
+    inactive_memory_bytes_ += frame->MemoryUsage();
+    inactive_image_bytes_ += frame->left_img_compressed_.capacity();
+    inactive_with_image_.push_back(frame);
+
+    // drop the oldest compressed images until we are within the budget
+    while (inactive_image_bytes_ > inactive_image_budget_ &&
+           !inactive_with_image_.empty()) {
+        auto oldest = inactive_with_image_.front();
+        size_t image_bytes = oldest->left_img_compressed_.capacity();
+        oldest->DropCompressedImage();
+        inactive_image_bytes_ -= image_bytes;
+        inactive_memory_bytes_ -= image_bytes;
+        inactive_with_image_.pop_front();
+    }
+
+    LOG(INFO) << "Inactive keyframes: " << keyframes_.size() -
+                                               active_keyframes_.size()
+              << ", with image: " << inactive_with_image_.size()
+              << ", memory: " << inactive_memory_bytes_ / 1024 << " KB";
+}
+
+size_t Map::MemoryUsage() {
+    std::unique_lock<std::mutex> lck(data_mutex_);
+    size_t bytes = inactive_memory_bytes_;
+    for (auto &kf : active_keyframes_) {
+        bytes += kf.second->MemoryUsage();
+    }
+    return bytes;
 }
 
 void Map::CleanMap() {
@@ -0,0 +1,175 @@
+#include "myslam/undistorter.h"
+
+#include <opencv2/opencv.hpp>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define MYSLAM_HAVE_AVX2_DISPATCH
+#endif
+
+namespace myslam {
+
+const int kWeightBits = 7;
+const int kWeightOne = 1 << kWeightBits;
+
+// bilinear interpolation of one pixel with 7 bit fixed point weights
+inline uchar InterpolateFixed(const uchar *src, int cols, int32_t offset,
+                              uint16_t weight) {
+    if (offset < 0) return 0;
+    const uchar *p = src + offset;
+    int fx = weight & 0xFF, fy = weight >> 8;
+    int top = p[0] * (kWeightOne - fx) + p[1] * fx;
+    int bottom = p[cols] * (kWeightOne - fx) + p[cols + 1] * fx;
+    return uchar((top * (kWeightOne - fy) + bottom * fy +
+                  (1 << (2 * kWeightBits - 1))) >>
+                 (2 * kWeightBits));
+}
+
+#ifdef MYSLAM_HAVE_AVX2_DISPATCH
+/**
+ * 8 pixels at a time: two 32-bit gathers fetch the top and bottom neighbour
+ * pairs, the weights are applied in 32-bit lanes.
+ * Lanes whose gather could read past the end of src fall back to scalar.
+ */
+__attribute__((target("avx2"))) static void InterpolateRowAVX2(
+    const uchar *src, int cols, int32_t max_gather_offset,
+    const int32_t *offsets, const uint16_t *weights, uchar *dst, int n) {
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi32(kWeightOne);
+    const __m256i mask_byte = _mm256_set1_epi32(0xFF);
+    const __m256i round = _mm256_set1_epi32(1 << (2 * kWeightBits - 1));
+    const __m256i limit = _mm256_set1_epi32(max_gather_offset);
+    const __m256i minus_one = _mm256_set1_epi32(-1);
+
+    int i = 0;
+    for (; i + 8 <= n; i += 8) {
+        __m256i off = _mm256_loadu_si256((const __m256i *)(offsets + i));
+        __m256i too_far = _mm256_cmpgt_epi32(off, limit);
+        if (!_mm256_testz_si256(too_far, too_far)) {
+            for (int k = i; k < i + 8; k++) {
+                dst[k] = InterpolateFixed(src, cols, offsets[k], weights[k]);
+            }
+            continue;
+        }
+        __m256i valid = _mm256_cmpgt_epi32(off, minus_one);
+
+        __m256i top = _mm256_mask_i32gather_epi32(zero, (const int *)src, off,
+                                                  valid, 1);
+        __m256i bottom = _mm256_mask_i32gather_epi32(
+            zero, (const int *)(src + cols), off, valid, 1);
+
+        __m256i w = _mm256_cvtepu16_epi32(
+            _mm_loadu_si128((const __m128i *)(weights + i)));
+        __m256i fx = _mm256_and_si256(w, mask_byte);
+        __m256i fy = _mm256_srli_epi32(w, 8);
+        __m256i fx_inv = _mm256_sub_epi32(one, fx);
+        __m256i fy_inv = _mm256_sub_epi32(one, fy);
+
+        __m256i p00 = _mm256_and_si256(top, mask_byte);
+        __m256i p01 = _mm256_and_si256(_mm256_srli_epi32(top, 8), mask_byte);
+        __m256i p10 = _mm256_and_si256(bottom, mask_byte);
+        __m256i p11 = _mm256_and_si256(_mm256_srli_epi32(bottom, 8), mask_byte);
+
+        __m256i t = _mm256_add_epi32(_mm256_mullo_epi32(p00, fx_inv),
+                                     _mm256_mullo_epi32(p01, fx));
+        __m256i b = _mm256_add_epi32(_mm256_mullo_epi32(p10, fx_inv),
+                                     _mm256_mullo_epi32(p11, fx));
+        __m256i v = _mm256_add_epi32(_mm256_mullo_epi32(t, fy_inv),
+                                     _mm256_mullo_epi32(b, fy));
+        v = _mm256_srli_epi32(_mm256_add_epi32(v, round), 2 * kWeightBits);
+        v = _mm256_and_si256(v, valid);  // outside pixels are black
+
+        __m128i v16 = _mm_packus_epi32(_mm256_castsi256_si128(v),
+                                       _mm256_extracti128_si256(v, 1));
+        __m128i v8 = _mm_packus_epi16(v16, v16);
+        _mm_storel_epi64((__m128i *)(dst + i), v8);
+    }
+    for (; i < n; i++) {
+        dst[i] = InterpolateFixed(src, cols, offsets[i], weights[i]);
+    }
+}
+#endif
+
+Undistorter::Undistorter(const Mat33 &K_src, const Vec4 &dist,
+                         const cv::Size &src_size, const Mat33 &K_dst,
+                         const cv::Size &dst_size, const Mat33 &R)
+    : src_size_(src_size), dst_size_(dst_size) {
+    const double k1 = dist[0], k2 = dist[1], p1 = dist[2], p2 = dist[3];
+    const double fx = K_src(0, 0), fy = K_src(1, 1), cx = K_src(0, 2),
+                 cy = K_src(1, 2);
+    const Mat33 K_dst_inv = K_dst.inverse();
+    const int cols = src_size.width, rows = src_size.height;
+
+    offsets_.resize(dst_size.area());
+    weights_.resize(dst_size.area());
+    for (int v = 0; v < dst_size.height; v++) {
+        for (int u = 0; u < dst_size.width; u++) {
+            int index = v * dst_size.width + u;
+            // ray of the output pixel, rotated into the raw camera
+            Vec3 ray = R * (K_dst_inv * Vec3(u, v, 1));
+            double x = ray[0] / ray[2], y = ray[1] / ray[2];
+            double r2 = x * x + y * y;
+            double radial = 1 + k1 * r2 + k2 * r2 * r2;
+            double x_distorted = x * radial + 2 * p1 * x * y + p2 * (r2 + 2 * x * x);
+            double y_distorted = y * radial + p1 * (r2 + 2 * y * y) + 2 * p2 * x * y;
+            double u_src = fx * x_distorted + cx;
+            double v_src = fy * y_distorted + cy;
+
+            if (ray[2] <= 0 || u_src < 0 || v_src < 0 || u_src > cols - 1 ||
+                v_src > rows - 1) {
+                offsets_[index] = -1;
+                weights_[index] = 0;
+                continue;
+            }
+
+            // keep the 2x2 neighbourhood inside the image
+            int x0 = std::min(int(u_src), cols - 2);
+            int y0 = std::min(int(v_src), rows - 2);
+            int wx = std::min(int(std::round((u_src - x0) * kWeightOne)), kWeightOne);
+            int wy = std::min(int(std::round((v_src - y0) * kWeightOne)), kWeightOne);
+            offsets_[index] = y0 * cols + x0;
+            weights_[index] = uint16_t(wx | (wy << 8));
+        }
+    }
+}
+
+void Undistorter::ApplyRows(const uchar *src, uchar *dst, size_t dst_step,
+                            int row_begin, int row_end) const {
+    const int cols = src_size_.width;
+    const int width = dst_size_.width;
+#ifdef MYSLAM_HAVE_AVX2_DISPATCH
+    static const bool has_avx2 = __builtin_cpu_supports("avx2");
+    // a 32-bit gather at offset + cols must stay inside the image
+    const int32_t max_gather_offset =
+        int32_t(src_size_.area()) - cols - int32_t(sizeof(int32_t));
+    if (has_avx2) {
+        for (int v = row_begin; v < row_end; v++) {
+            InterpolateRowAVX2(src, cols, max_gather_offset,
+                               &offsets_[v * width], &weights_[v * width],
+                               dst + v * dst_step, width);
+        }
+        return;
+    }
+#endif
+    for (int v = row_begin; v < row_end; v++) {
+        const int32_t *offsets = &offsets_[v * width];
+        const uint16_t *weights = &weights_[v * width];
+        uchar *row = dst + v * dst_step;
+        for (int u = 0; u < width; u++) {
+            row[u] = InterpolateFixed(src, cols, offsets[u], weights[u]);
+        }
+    }
+}
+
+void Undistorter::Apply(const cv::Mat &src, cv::Mat &dst) const {
+    CHECK(src.type() == CV_8UC1 && src.size() == src_size_)
+        << "undistorter expects a gray image of the calibrated size";
+    cv::Mat src_continuous = src.isContinuous() ? src : src.clone();
+    dst.create(dst_size_, CV_8UC1);
+    cv::parallel_for_(cv::Range(0, dst_size_.height), [&](const cv::Range &range) {
+        ApplyRows(src_continuous.data, dst.data, dst.step, range.start,
+                  range.end);
+    });
+}
+
+}  // namespace myslam
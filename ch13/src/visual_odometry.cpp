@@ -36,23 +36,83 @@ bool VisualOdometry::Init() {
 
     viewer_->SetMap(map_);
 
+    map_->SetInactiveImageBudget(
+        size_t(Config::Get<int>("inactive_image_budget_mb", 256)) << 20);
+
+    realtime_ = Config::Get<int>("realtime", 0) != 0;
+    latency_budget_ = Config::Get<double>("latency_budget", 0.1);
+    playback_speed_ = Config::Get<double>("playback_speed", 1.0);
+
     return true;
 }
 
 void VisualOdometry::Run() {
-    while (1) {
-        LOG(INFO) << "VO is running";
-        if (Step() == false) {
-            break;
+    if (realtime_) {
+        RunRealtime();
+    } else {
+        while (1) {
+            LOG(INFO) << "VO is running";
+            if (Step() == false) {
+                break;
+            }
         }
     }
 
+    LOG(INFO) << "Keyframe memory: " << map_->MemoryUsage() / 1024 << " KB";
+
     backend_->Stop();
     viewer_->Close();
 
     LOG(INFO) << "VO exit";
 }
 
+void VisualOdometry::RunRealtime() {
+    using namespace std::chrono;
+    typedef duration<double> Seconds;
+
+    double first_timestamp = dataset_->PeekTimestamp();
+    if (first_timestamp < 0) return;
+    auto start = steady_clock::now();
+
+    while (1) {
+        double timestamp = dataset_->PeekTimestamp();
+        if (timestamp < 0) break;
+
+        // the time this frame is delivered by the camera
+        auto arrival = start + duration_cast<steady_clock::duration>(Seconds(
+                                   (timestamp - first_timestamp) /
+                                   playback_speed_));
+        auto now = steady_clock::now();
+        if (now < arrival) {
+            // we are ahead of the camera, wait for the frame
+            std::this_thread::sleep_until(arrival);
+        } else if (num_frames_processed_ > 0 &&
+                   Seconds(now - arrival).count() > latency_budget_) {
+            // stale frame, skip it without even loading the images
+            dataset_->SkipFrame();
+            num_frames_dropped_++;
+            continue;
+        }
+
+        if (Step() == false) break;
+
+        double latency = Seconds(steady_clock::now() - arrival).count();
+        num_frames_processed_++;
+        total_latency_ += latency;
+        max_latency_ = std::max(max_latency_, latency);
+        if (latency > latency_budget_) num_deadline_misses_++;
+    }
+
+    LOG(INFO) << "Realtime statistics: processed " << num_frames_processed_
+              << ", dropped " << num_frames_dropped_ << ", deadline misses "
+              << num_deadline_misses_;
+    if (num_frames_processed_ > 0) {
+        LOG(INFO) << "End-to-end latency: mean "
+                  << total_latency_ / num_frames_processed_ << " s, max "
+                  << max_latency_ << " s";
+    }
+}
+
 bool VisualOdometry::Step() {
     Frame::Ptr new_frame = dataset_->NextFrame();
     if (new_frame == nullptr) return false;
@@ -0,0 +1,119 @@
+#include <gtest/gtest.h>
+#include <algorithm>
+#include <random>
+#include "myslam/common_include.h"
+#include "binary_index.h"
+
+namespace {
+
+/// k nearest neighbours within radius by brute force, ordered by (distance, index)
+std::vector<std::pair<int, int>> BruteForceKnn(const cv::Mat &db, const uchar *query,
+                                               int k, int radius) {
+    std::vector<std::pair<int, int>> result;
+    for (int i = 0; i < db.rows; i++) {
+        int dist = cv::norm(cv::Mat(1, 32, CV_8UC1, (void *)query), db.row(i),
+                            cv::NORM_HAMMING);
+        if (dist <= radius) result.push_back(std::make_pair(dist, i));
+    }
+    std::sort(result.begin(), result.end());
+    if (int(result.size()) > k) result.resize(k);
+    return result;
+}
+
+/// random descriptors, a quarter of them near copies of earlier ones so there are close pairs and ties
+cv::Mat RandomDescriptors(int n, std::mt19937 &rng) {
+    cv::Mat desc(n, 32, CV_8UC1);
+    for (int i = 0; i < n; i++) {
+        uchar *row = desc.ptr<uchar>(i);
+        if (i > 0 && rng() % 4 == 0) {
+            memcpy(row, desc.ptr<uchar>(rng() % i), 32);
+            int flips = rng() % 30;
+            for (int b = 0; b < flips; b++) row[rng() % 32] ^= 1 << (rng() % 8);
+        } else {
+            for (int j = 0; j < 32; j++) row[j] = rng() % 256;
+        }
+    }
+    return desc;
+}
+
+/// number of differences between knnSearch and the brute force search
+int CountMismatches(slambook::MultiIndexHash &index, const cv::Mat &db, const uchar *query,
+                    int k, int radius, int query_idx) {
+    std::vector<cv::DMatch> result;
+    index.knnSearch(query, k, radius, result, query_idx);
+    auto expected = BruteForceKnn(db, query, k, radius);
+    if (result.size() != expected.size()) return 1;
+    int mismatches = 0;
+    for (size_t i = 0; i < result.size(); i++) {
+        if (result[i].trainIdx != expected[i].second ||
+            result[i].distance != expected[i].first || result[i].queryIdx != query_idx)
+            mismatches++;
+    }
+    return mismatches;
+}
+
+}  // namespace
+
+TEST(MyslamTest, MultiIndexHashMatchesBruteForce) {
+    std::mt19937 rng(7);
+    cv::Mat db = RandomDescriptors(5000, rng);
+    slambook::MultiIndexHash index;
+    // added in two batches, so the second search rebuilds the table
+    index.add(db.rowRange(0, 2000));
+    std::vector<cv::DMatch> result;
+    index.knnSearch(db.ptr<uchar>(0), 1, 0, result);
+    ASSERT_EQ(result.size(), 1u);
+    index.add(db.rowRange(2000, db.rows));
+    ASSERT_EQ(index.size(), db.rows);
+
+    int mismatches = 0;
+    for (int t = 0; t < 300; t++) {
+        // queries near a descriptor of the set, or unrelated to all of them
+        uchar query[32];
+        memcpy(query, db.ptr<uchar>(rng() % db.rows), 32);
+        int flips = t % 5 == 0 ? 256 : rng() % 45;
+        for (int b = 0; b < flips; b++) query[rng() % 32] ^= 1 << (rng() % 8);
+        mismatches += CountMismatches(index, db, query, 1 + t % 3, 10 + t % 60, t);
+    }
+    EXPECT_EQ(mismatches, 0);
+
+    // the search stops at level s, table j once 16 * s + j is out of reach. a descriptor with s + 1
+    // different bits in each of the first j substrings and s in the others is exactly at that bound
+    // and is first found there, so these queries catch a stop rule that is off by one
+    mismatches = 0;
+    int bits[16];
+    for (int b = 0; b < 16; b++) bits[b] = b;
+    for (int s = 0; s < 3; s++) {
+        for (int j = 0; j < 16; j++) {
+            uchar query[32];
+            memcpy(query, db.ptr<uchar>(rng() % db.rows), 32);
+            for (int sub = 0; sub < 16; sub++) {
+                std::shuffle(bits, bits + 16, rng);
+                for (int f = 0; f < (sub < j ? s + 1 : s); f++)
+                    query[sub * 2 + bits[f] / 8] ^= 1 << (bits[f] % 8);
+            }
+            mismatches += CountMismatches(index, db, query, 1, 16 * s + j, 0);
+            mismatches += CountMismatches(index, db, query, 2, 16 * s + j + 8, 0);
+        }
+    }
+    EXPECT_EQ(mismatches, 0);
+
+    // knnMatch gives the same as one knnSearch per row
+    cv::Mat queries = RandomDescriptors(50, rng);
+    std::vector<std::vector<cv::DMatch>> matches;
+    index.knnMatch(queries, 2, 40, matches);
+    ASSERT_EQ(int(matches.size()), queries.rows);
+    for (int i = 0; i < queries.rows; i++) {
+        auto expected = BruteForceKnn(db, queries.ptr<uchar>(i), 2, 40);
+        ASSERT_EQ(matches[i].size(), expected.size());
+        for (size_t j = 0; j < expected.size(); j++) {
+            EXPECT_EQ(matches[i][j].trainIdx, expected[j].second);
+            EXPECT_EQ(matches[i][j].distance, expected[j].first);
+        }
+    }
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
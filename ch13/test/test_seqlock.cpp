@@ -0,0 +1,32 @@
+#include <gtest/gtest.h>
+#include "myslam/common_include.h"
+#include "myslam/seqlock.h"
+
+TEST(MyslamTest, SeqLockConsistentRead) {
+    myslam::SeqLock<Vec3> pos(Vec3::Zero());
+    std::atomic<bool> running(true);
+
+    // the writer always stores a vector with three equal entries
+    std::thread writer([&]() {
+        for (int i = 1; i <= 200000; ++i) {
+            pos.Store(Vec3(i, i, i));
+        }
+        running.store(false);
+    });
+
+    int torn_reads = 0;
+    while (running.load()) {
+        Vec3 p = pos.Load();
+        if (p[0] != p[1] || p[1] != p[2]) torn_reads++;
+    }
+    writer.join();
+
+    EXPECT_EQ(torn_reads, 0);
+    EXPECT_EQ(pos.Load()[0], 200000);
+    EXPECT_EQ(pos.Version(), 200001u);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
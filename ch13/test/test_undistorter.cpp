@@ -0,0 +1,25 @@
+#include <gtest/gtest.h>
+#include <opencv2/opencv.hpp>
+#include "myslam/common_include.h"
+#include "myslam/undistorter.h"
+
+TEST(MyslamTest, UndistorterIdentity) {
+    cv::Mat img(48, 67, CV_8UC1);
+    cv::randu(img, 0, 256);
+
+    // without distortion and with the same intrinsics the table is a copy
+    Mat33 K;
+    K << 50, 0, 33, 0, 50, 24, 0, 0, 1;
+    myslam::Undistorter undistorter(K, Vec4::Zero(), img.size(), K,
+                                    img.size());
+    cv::Mat out;
+    undistorter.Apply(img, out);
+
+    ASSERT_EQ(out.size(), img.size());
+    EXPECT_EQ(cv::countNonZero(out != img), 0);
+}
+
+int main(int argc, char **argv) {
+    ::testing::InitGoogleTest(&argc, argv);
+    return RUN_ALL_TESTS();
+}
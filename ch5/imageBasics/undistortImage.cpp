@@ -1,5 +1,6 @@
 #include <opencv2/opencv.hpp>
 #include <string>
+#include <vector>
 
 using namespace std;
 
@@ -17,7 +18,11 @@ int main(int argc, char **argv) {
   int rows = image.rows, cols = image.cols;
   cv::Mat image_undistort = cv::Mat(rows, cols, CV_8UC1);   // 去畸变以后的图
 
-  // 计算去畸变后图像的内容
+  // 畸变模型只和像素坐标有关，因此对每个像素只需算一次，存成查找表：
+  // 畸变图像中左上邻居的偏移，以及 7 位定点的双线性插值权重（0~128）
+  // 对同一相机的后续图像，只需查表插值即可
+  vector<int> offsets(rows * cols);
+  vector<unsigned short> weights(rows * cols);
   for (int v = 0; v < rows; v++) {
     for (int u = 0; u < cols; u++) {
       // 按照公式，计算点(u,v)对应到畸变图像中的坐标(u_distorted, v_distorted)
@@ -28,15 +33,40 @@ int main(int argc, char **argv) {
       double u_distorted = fx * x_distorted + cx;
       double v_distorted = fy * y_distorted + cy;
 
-      // 赋值 (最近邻插值)
-      if (u_distorted >= 0 && v_distorted >= 0 && u_distorted < cols && v_distorted < rows) {
-        image_undistort.at<uchar>(v, u) = image.at<uchar>((int) v_distorted, (int) u_distorted);
+      int index = v * cols + u;
+      if (u_distorted >= 0 && v_distorted >= 0 && u_distorted <= cols - 1 && v_distorted <= rows - 1) {
+        int x0 = min((int) u_distorted, cols - 2), y0 = min((int) v_distorted, rows - 2);
+        int wx = min((int) round((u_distorted - x0) * 128), 128);
+        int wy = min((int) round((v_distorted - y0) * 128), 128);
+        offsets[index] = y0 * cols + x0;
+        weights[index] = (unsigned short) (wx | (wy << 8));
       } else {
-        image_undistort.at<uchar>(v, u) = 0;
+        offsets[index] = -1;   // 落在图像外面
+        weights[index] = 0;
       }
     }
   }
 
+  // 计算去畸变后图像的内容（双线性插值，整数运算，按行并行）
+  if (!image.isContinuous()) image = image.clone();
+  cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+    for (int v = range.start; v < range.end; v++) {
+      uchar *row = image_undistort.ptr<uchar>(v);
+      for (int u = 0; u < cols; u++) {
+        int index = v * cols + u;
+        if (offsets[index] < 0) {
+          row[u] = 0;
+          continue;
+        }
+        const uchar *p = image.data + offsets[index];
+        int wx = weights[index] & 0xFF, wy = weights[index] >> 8;
+        int top = p[0] * (128 - wx) + p[1] * wx;
+        int bottom = p[cols] * (128 - wx) + p[cols + 1] * wx;
+        row[u] = (uchar) ((top * (128 - wy) + bottom * wy + 8192) >> 14);
+      }
+    }
+  });
+
   // 画图去畸变后图像
   cv::imshow("distorted", image);
   cv::imshow("undistorted", image_undistort);
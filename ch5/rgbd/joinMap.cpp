@@ -4,15 +4,14 @@
 #include <boost/format.hpp>  // for formating strings
 #include <pangolin/pangolin.h>
 #include <sophus/se3.hpp>
+#include "backprojection.h"   // 共用的反投影，在仓库根目录的 common 下
 
 
 using namespace std;
 typedef vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d>> TrajectoryType;
-typedef Eigen::Matrix<double, 6, 1> Vector6d;
 
 // 在pangolin中画图，已写好，无需调整
-void showPointCloud(
-    const vector<Vector6d, Eigen::aligned_allocator<Vector6d>> &pointcloud);
+void showPointCloud(const slambook::PointBuffer &pointcloud);
 
 int main(int argc, char **argv) {
     vector<cv::Mat> colorImgs, depthImgs;    // 彩色图和深度图
@@ -44,41 +43,23 @@ int main(int argc, char **argv) {
     double fx = 518.0;
     double fy = 519.0;
     double depthScale = 1000.0;
-    vector<Vector6d, Eigen::aligned_allocator<Vector6d>> pointcloud;
-    pointcloud.reserve(1000000);
 
-    for (int i = 0; i < 5; i++) {
-        cout << "转换图像中: " << i + 1 << endl;
-        cv::Mat color = colorImgs[i];
-        cv::Mat depth = depthImgs[i];
-        Sophus::SE3d T = poses[i];
-        for (int v = 0; v < color.rows; v++)
-            for (int u = 0; u < color.cols; u++) {
-                unsigned int d = depth.ptr<unsigned short>(v)[u]; // 深度值
-                if (d == 0) continue; // 为0表示没有测量到
-                Eigen::Vector3d point;
-                point[2] = double(d) / depthScale;
-                point[0] = (u - cx) * point[2] / fx;
-                point[1] = (v - cy) * point[2] / fy;
-                Eigen::Vector3d pointWorld = T * point;
-
-                Vector6d p;
-                p.head<3>() = pointWorld;
-                p[5] = color.data[v * color.step + u * color.channels()];   // blue
-                p[4] = color.data[v * color.step + u * color.channels() + 1]; // green
-                p[3] = color.data[v * color.step + u * color.channels() + 2]; // red
-                pointcloud.push_back(p);
-            }
-    }
+    // 归一化坐标只和内参有关，算一次即可；五张图按帧和行一起并行反投影
+    slambook::RayTable rays(fx, fy, cx, cy, depthImgs[0].cols, depthImgs[0].rows);
+    slambook::PointBuffer pointcloud;
+    cout << "转换图像中..." << endl;
+    slambook::backProjectFrames(rays, depthImgs, colorImgs, depthScale, poses, pointcloud);
 
-    cout << "点云共有" << pointcloud.size() << "个点." << endl;
+    size_t num_points = 0;
+    for (int i = 0; i < pointcloud.frames; i++) num_points += pointcloud.countValid(i);
+    cout << "点云共有" << num_points << "个点." << endl;
     showPointCloud(pointcloud);
     return 0;
 }
 
-void showPointCloud(const vector<Vector6d, Eigen::aligned_allocator<Vector6d>> &pointcloud) {
+void showPointCloud(const slambook::PointBuffer &pointcloud) {
 
-    if (pointcloud.empty()) {
+    if (pointcloud.valid.empty()) {
         cerr << "Point cloud is empty!" << endl;
         return;
     }
@@ -105,9 +86,10 @@ void showPointCloud(const vector<Vector6d, Eigen::aligned_allocator<Vector6d>> &
 
         glPointSize(2);
         glBegin(GL_POINTS);
-        for (auto &p: pointcloud) {
-            glColor3d(p[3] / 255.0, p[4] / 255.0, p[5] / 255.0);
-            glVertex3d(p[0], p[1], p[2]);
+        for (size_t i = 0; i < pointcloud.valid.size(); i++) {
+            if (!pointcloud.valid[i]) continue;
+            glColor3ub(pointcloud.r[i], pointcloud.g[i], pointcloud.b[i]);
+            glVertex3f(pointcloud.x[i], pointcloud.y[i], pointcloud.z[i]);
         }
         glEnd();
         pangolin::FinishFrame();
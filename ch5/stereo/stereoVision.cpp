@@ -1,9 +1,17 @@
 #include <opencv2/opencv.hpp>
 #include <vector>
 #include <string>
+#include <chrono>
+#include <fstream>
+#include <iostream>
 #include <Eigen/Core>
 #include <pangolin/pangolin.h>
 #include <unistd.h>
+#include <cstdio>
+#include <cstring>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 
 using namespace std;
 using namespace Eigen;
@@ -12,46 +20,97 @@ using namespace Eigen;
 string left_file = "./left.png";
 string right_file = "./right.png";
 
+// 内参
+double fx = 718.856, fy = 718.856, cx = 607.1928, cy = 185.2157;
+// 基线
+double b = 0.573;
+// 视差的有效范围，与SGBM的numDisparities一致
+float max_disparity = 96.0;
+
+/// 点云，每个坐标分量单独一个数组（SoA），每个像素一个位置，z = 0 表示无效点
+struct PointCloudSoA {
+    vector<float> x, y, z, gray;
+    int rows = 0, cols = 0;
+
+    void resize(int r, int c) {
+        rows = r;
+        cols = c;
+        x.resize(r * c);
+        y.resize(r * c);
+        z.resize(r * c);
+        gray.resize(r * c);
+    }
+};
+
+/**
+ * 视差图转点云，按行并行，有 SSE2 时每行一次算 4 个像素
+ * @param [in] disparity CV_32F 视差图
+ * @param [in] left 左图，用于点的颜色
+ * @param [out] cloud 预先分配的点云，尺寸不对时会重新分配
+ */
+void disparityToPointCloud(const cv::Mat &disparity, const cv::Mat &left, PointCloudSoA &cloud);
+
+/// 把点云中的有效点写成二进制 ply，返回有效点数
+int savePointCloud(const string &file, const PointCloudSoA &cloud);
+
+/// 在SGBM视差上计算一对图像的点云
+void computePointCloud(const cv::Mat &left, const cv::Mat &right, cv::Ptr<cv::StereoSGBM> sgbm,
+                       cv::Mat &disparity, PointCloudSoA &cloud);
+
 // 在pangolin中画图，已写好，无需调整
-void showPointCloud(
-    const vector<Vector4d, Eigen::aligned_allocator<Vector4d>> &pointcloud);
+void showPointCloud(const PointCloudSoA &pointcloud);
 
 int main(int argc, char **argv) {
 
-    // 内参
-    double fx = 718.856, fy = 718.856, cx = 607.1928, cy = 185.2157;
-    // 基线
-    double b = 0.573;
+    cv::Ptr<cv::StereoSGBM> sgbm = cv::StereoSGBM::create(
+        0, 96, 9, 8 * 9 * 9, 32 * 9 * 9, 1, 63, 10, 100, 32);    // 神奇的参数
+    cv::Mat disparity;
+    PointCloudSoA pointcloud;   // 在整个序列中复用，避免反复分配
+
+    if (argc == 3) {
+        // 序列模式：stereoVision kitti序列目录 输出目录
+        // 依次读取 image_0/%06d.png 和 image_1/%06d.png，每帧保存一个点云
+        string dataset_dir = argv[1], output_dir = argv[2];
+        char path[1024];
+        double total_time = 0;
+        int index = 0;
+        for (;; index++) {
+            snprintf(path, sizeof(path), "%s/image_0/%06d.png", dataset_dir.c_str(), index);
+            cv::Mat left = cv::imread(path, 0);
+            snprintf(path, sizeof(path), "%s/image_1/%06d.png", dataset_dir.c_str(), index);
+            cv::Mat right = cv::imread(path, 0);
+            if (left.data == nullptr || right.data == nullptr) break;
+
+            chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+            computePointCloud(left, right, sgbm, disparity, pointcloud);
+            chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+            double time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1).count();
+            total_time += time_used;
+
+            snprintf(path, sizeof(path), "%s/%06d.ply", output_dir.c_str(), index);
+            int num_points = savePointCloud(path, pointcloud);
+            cout << "frame " << index << ": " << num_points << " points, time " << time_used * 1000 << " ms"
+                 << endl;
+        }
+        if (index > 0) {
+            cout << "processed " << index << " frames, average " << total_time / index * 1000 << " ms" << endl;
+        }
+        return 0;
+    }
 
     // 读取图像
     cv::Mat left = cv::imread(left_file, 0);
     cv::Mat right = cv::imread(right_file, 0);
-    cv::Ptr<cv::StereoSGBM> sgbm = cv::StereoSGBM::create(
-        0, 96, 9, 8 * 9 * 9, 32 * 9 * 9, 1, 63, 10, 100, 32);    // 神奇的参数
-    cv::Mat disparity_sgbm, disparity;
+    cv::Mat disparity_sgbm;
     sgbm->compute(left, right, disparity_sgbm);
     disparity_sgbm.convertTo(disparity, CV_32F, 1.0 / 16.0f);
 
     // 生成点云
-    vector<Vector4d, Eigen::aligned_allocator<Vector4d>> pointcloud;
-
-    // 如果你的机器慢，请把后面的v++和u++改成v+=2, u+=2
-    for (int v = 0; v < left.rows; v++)
-        for (int u = 0; u < left.cols; u++) {
-            if (disparity.at<float>(v, u) <= 0.0 || disparity.at<float>(v, u) >= 96.0) continue;
-
-            Vector4d point(0, 0, 0, left.at<uchar>(v, u) / 255.0); // 前三维为xyz,第四维为颜色
-
-            // 根据双目模型计算 point 的位置
-            double x = (u - cx) / fx;
-            double y = (v - cy) / fy;
-            double depth = fx * b / (disparity.at<float>(v, u));
-            point[0] = x * depth;
-            point[1] = y * depth;
-            point[2] = depth;
-
-            pointcloud.push_back(point);
-        }
+    chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
+    disparityToPointCloud(disparity, left, pointcloud);
+    chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
+    chrono::duration<double> time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+    cout << "disparity to point cloud: " << time_used.count() * 1000 << " ms" << endl;
 
     cv::imshow("disparity", disparity / 96.0);
     cv::waitKey(0);
@@ -60,9 +119,85 @@ int main(int argc, char **argv) {
     return 0;
 }
 
-void showPointCloud(const vector<Vector4d, Eigen::aligned_allocator<Vector4d>> &pointcloud) {
+void computePointCloud(const cv::Mat &left, const cv::Mat &right, cv::Ptr<cv::StereoSGBM> sgbm,
+                       cv::Mat &disparity, PointCloudSoA &cloud) {
+    cv::Mat disparity_sgbm;
+    sgbm->compute(left, right, disparity_sgbm);
+    disparity_sgbm.convertTo(disparity, CV_32F, 1.0 / 16.0f);
+    disparityToPointCloud(disparity, left, cloud);
+}
+
+void disparityToPointCloud(const cv::Mat &disparity, const cv::Mat &left, PointCloudSoA &cloud) {
+    int rows = disparity.rows, cols = disparity.cols;
+    if (cloud.rows != rows || cloud.cols != cols) cloud.resize(rows, cols);
+
+    // 归一化坐标 x 只与列有关，预先算好
+    vector<float> x_norm(cols);
+    for (int u = 0; u < cols; u++) x_norm[u] = float((u - cx) / fx);
+    const float fxb = float(fx * b);
+
+    cv::parallel_for_(cv::Range(0, rows), [&](const cv::Range &range) {
+        for (int v = range.start; v < range.end; v++) {
+            const float *disp = disparity.ptr<float>(v);
+            const uchar *color = left.ptr<uchar>(v);
+            const float y_norm = float((v - cy) / fy);
+            float *px = &cloud.x[v * cols], *py = &cloud.y[v * cols];
+            float *pz = &cloud.z[v * cols], *pg = &cloud.gray[v * cols];
+            int u = 0;
+#ifdef __SSE2__
+            const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+            const __m128 max_d = _mm_set1_ps(max_disparity), fxb4 = _mm_set1_ps(fxb);
+            const __m128 y4 = _mm_set1_ps(y_norm), gray_scale = _mm_set1_ps(1.0f / 255.0f);
+            for (; u + 4 <= cols; u += 4) {
+                __m128 d = _mm_loadu_ps(disp + u);
+                __m128 valid = _mm_and_ps(_mm_cmpgt_ps(d, zero), _mm_cmplt_ps(d, max_d));
+                // 无效视差换成 1 再做除法，不会除以 0，结果再用掩码置为 0
+                __m128 divisor = _mm_or_ps(_mm_and_ps(valid, d), _mm_andnot_ps(valid, one));
+                __m128 depth = _mm_and_ps(valid, _mm_div_ps(fxb4, divisor));
+                _mm_storeu_ps(px + u, _mm_mul_ps(_mm_loadu_ps(&x_norm[u]), depth));
+                _mm_storeu_ps(py + u, _mm_mul_ps(y4, depth));
+                _mm_storeu_ps(pz + u, depth);
+                int c4;
+                memcpy(&c4, color + u, 4);
+                __m128i c = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(c4), _mm_setzero_si128()),
+                                               _mm_setzero_si128());
+                _mm_storeu_ps(pg + u, _mm_mul_ps(_mm_cvtepi32_ps(c), gray_scale));
+            }
+#endif
+            for (; u < cols; u++) {
+                // 根据双目模型计算 point 的位置，无效视差的深度置为0
+                float d = disp[u];
+                bool valid = d > 0.0f && d < max_disparity;
+                float depth = valid ? fxb / d : 0.0f;
+                px[u] = x_norm[u] * depth;
+                py[u] = y_norm * depth;
+                pz[u] = depth;
+                pg[u] = color[u] * (1.0f / 255.0f);
+            }
+        }
+    });
+}
 
-    if (pointcloud.empty()) {
+int savePointCloud(const string &file, const PointCloudSoA &cloud) {
+    int num_points = 0;
+    for (float z : cloud.z) num_points += z > 0;
+
+    ofstream fout(file, ios::binary);
+    fout << "ply\nformat binary_little_endian 1.0\n"
+         << "element vertex " << num_points << "\n"
+         << "property float x\nproperty float y\nproperty float z\nproperty float intensity\n"
+         << "end_header\n";
+    for (size_t i = 0; i < cloud.z.size(); i++) {
+        if (cloud.z[i] <= 0) continue;
+        float point[4] = {cloud.x[i], cloud.y[i], cloud.z[i], cloud.gray[i]};
+        fout.write((const char *) point, sizeof(point));
+    }
+    return num_points;
+}
+
+void showPointCloud(const PointCloudSoA &pointcloud) {
+
+    if (pointcloud.z.empty()) {
         cerr << "Point cloud is empty!" << endl;
         return;
     }
@@ -89,13 +224,14 @@ void showPointCloud(const vector<Vector4d, Eigen::aligned_allocator<Vector4d>> &
 
         glPointSize(2);
         glBegin(GL_POINTS);
-        for (auto &p: pointcloud) {
-            glColor3f(p[3], p[3], p[3]);
-            glVertex3d(p[0], p[1], p[2]);
+        for (size_t i = 0; i < pointcloud.z.size(); i++) {
+            if (pointcloud.z[i] <= 0) continue;
+            glColor3f(pointcloud.gray[i], pointcloud.gray[i], pointcloud.gray[i]);
+            glVertex3f(pointcloud.x[i], pointcloud.y[i], pointcloud.z[i]);
         }
         glEnd();
         pangolin::FinishFrame();
         usleep(5000);   // sleep 5 ms
     }
     return;
-}
\ No newline at end of file
+}
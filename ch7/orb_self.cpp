@@ -5,7 +5,9 @@
 #include <opencv2/opencv.hpp>
 #include <string>
 #include <nmmintrin.h>
+#include <immintrin.h>
 #include <chrono>
+#include "binary_index.h"
 
 using namespace std;
 
@@ -16,6 +18,19 @@ string second_file = "./2.png";
 // 32 bit unsigned int, will have 8, 8x32=256
 typedef vector<uint32_t> DescType; // Descriptor type
 
+/**
+ * detect FAST-9 corners spread over a grid, with a predictable number of keypoints
+ * every cell starts with the highest threshold and retries lower ones until it has its share of corners,
+ * then keeps its strongest corners after non-maximum suppression
+ * @param img input image
+ * @param keypoints detected keypoints, response is the FAST score
+ * @param num_features keypoint budget, the result has at most this many
+ * @param cell_size size of the grid cells in pixels
+ * @param border no keypoints closer to the image border than this, ComputeORB needs the rotated pattern radius, 19 pixels
+ */
+void DetectFAST(const cv::Mat &img, vector<cv::KeyPoint> &keypoints, int num_features = 1000,
+                int cell_size = 32, int border = 19);
+
 /**
  * compute descriptor of orb keypoints
  * @param img input image
@@ -32,8 +47,11 @@ void ComputeORB(const cv::Mat &img, vector<cv::KeyPoint> &keypoints, vector<Desc
  * @param desc1 the first descriptor
  * @param desc2 the second descriptor
  * @param matches matches of two images
+ * @param ratio keep a match only if the best distance < ratio * the second best, 1 to disable
+ * @param cross_check keep a match only if it is also the best match from desc2 to desc1
  */
-void BfMatch(const vector<DescType> &desc1, const vector<DescType> &desc2, vector<cv::DMatch> &matches);
+void BfMatch(const vector<DescType> &desc1, const vector<DescType> &desc2, vector<cv::DMatch> &matches,
+             float ratio = 1, bool cross_check = false);
 
 int main(int argc, char **argv) {
 
@@ -42,17 +60,17 @@ int main(int argc, char **argv) {
   cv::Mat second_image = cv::imread(second_file, 0);
   assert(first_image.data != nullptr && second_image.data != nullptr);
 
-  // detect FAST keypoints1 using threshold=40
+  // detect FAST keypoints1 on a grid, starting with threshold=40
   chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
   vector<cv::KeyPoint> keypoints1;
-  cv::FAST(first_image, keypoints1, 40);
+  DetectFAST(first_image, keypoints1);
   vector<DescType> descriptor1;
   ComputeORB(first_image, keypoints1, descriptor1);
 
   // same for the second
   vector<cv::KeyPoint> keypoints2;
   vector<DescType> descriptor2;
-  cv::FAST(second_image, keypoints2, 40);
+  DetectFAST(second_image, keypoints2);
   ComputeORB(second_image, keypoints2, descriptor2);
   chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
   chrono::duration<double> time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
@@ -61,12 +79,32 @@ int main(int argc, char **argv) {
   // find matches
   vector<cv::DMatch> matches;
   t1 = chrono::steady_clock::now();
-  BfMatch(descriptor1, descriptor2, matches);
+  BfMatch(descriptor1, descriptor2, matches, 0.8, true);
   t2 = chrono::steady_clock::now();
   time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
   cout << "match ORB cost = " << time_used.count() << " seconds. " << endl;
   cout << "matches: " << matches.size() << endl;
 
+  // the same search through a multi-index hash over the second image, the way a large map would be searched.
+  // 2 nearest neighbors within 50 bits are enough for the 0.8 ratio test with d_max = 40
+  t1 = chrono::steady_clock::now();
+  slambook::MultiIndexHash index;
+  for (auto &desc : descriptor2) {
+    if (!desc.empty()) index.add((const uchar *) desc.data());
+  }
+  int hash_matches = 0;
+  vector<cv::DMatch> knn;
+  for (size_t i = 0; i < descriptor1.size(); i++) {
+    if (descriptor1[i].empty()) continue;
+    index.knnSearch((const uchar *) descriptor1[i].data(), 2, 50, knn, i);
+    if (!knn.empty() && knn[0].distance < 40 && (knn.size() < 2 || knn[0].distance < 0.8 * knn[1].distance))
+      hash_matches++;
+  }
+  t2 = chrono::steady_clock::now();
+  time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+  cout << "match ORB by multi-index hashing cost = " << time_used.count() << " seconds, without cross check: "
+       << hash_matches << endl;
+
   // plot the matches
   cv::Mat image_show;
   cv::drawMatches(first_image, keypoints1, second_image, keypoints2, matches, image_show);
@@ -78,6 +116,164 @@ int main(int argc, char **argv) {
   return 0;
 }
 
+// -------------------------------------------------------------------------------------------------- //
+// FAST detector
+// the 16 pixels on a circle of radius 3, clockwise from the top
+const int fast_circle[16][2] = {
+  {0, -3}, {1, -3}, {2, -2}, {3, -1}, {3, 0}, {3, 1}, {2, 2}, {1, 3},
+  {0, 3}, {-1, 3}, {-2, 2}, {-3, 1}, {-3, 0}, {-3, -1}, {-2, -2}, {-1, -3}
+};
+
+// thresholds tried by each cell, from high to low
+const int fast_thresholds[] = {40, 20, 10};
+
+/// segment test: 9 contiguous circle pixels all brighter than center + t or all darker than center - t
+inline bool IsFASTCorner(const uchar *p, const int *circle, int t) {
+  const int v = p[0];
+  int bright = 0, dark = 0;
+  for (int k = 0; k < 16 + 8; k++) {
+    int x = p[circle[k % 16]];
+    bright = x > v + t ? bright + 1 : 0;
+    dark = x < v - t ? dark + 1 : 0;
+    if (bright >= 9 || dark >= 9) return true;
+  }
+  return false;
+}
+
+/// FAST score: the largest threshold at which p is still a corner, p must be a corner at t
+inline int FASTScore(const uchar *p, const int *circle, int t) {
+  int lo = t, hi = 255;
+  while (lo < hi) {
+    int mid = (lo + hi + 1) / 2;
+    if (IsFASTCorner(p, circle, mid)) lo = mid;
+    else hi = mid - 1;
+  }
+  return lo;
+}
+
+/**
+ * segment test on 16 pixels of a row starting at p, bit i of the result is set if p + i is a corner
+ * bytes are shifted by 0x80 so the signed compare works on unsigned pixels
+ */
+inline int FASTCorners16(const uchar *p, const int *circle, int t) {
+  const __m128i sign = _mm_set1_epi8(char(0x80)), threshold = _mm_set1_epi8(char(t));
+  const __m128i center = _mm_loadu_si128((const __m128i *) p);
+  const __m128i bright = _mm_xor_si128(_mm_adds_epu8(center, threshold), sign);
+  const __m128i dark = _mm_xor_si128(_mm_subs_epu8(center, threshold), sign);
+  __m128i x[16];
+  for (int k = 0; k < 16; k++) x[k] = _mm_xor_si128(_mm_loadu_si128((const __m128i *) (p + circle[k])), sign);
+
+  // an arc of 9 always covers two neighboring pixels out of 0, 4, 8 and 12
+  __m128i b0 = _mm_cmpgt_epi8(x[0], bright), b4 = _mm_cmpgt_epi8(x[4], bright);
+  __m128i b8 = _mm_cmpgt_epi8(x[8], bright), b12 = _mm_cmpgt_epi8(x[12], bright);
+  __m128i d0 = _mm_cmpgt_epi8(dark, x[0]), d4 = _mm_cmpgt_epi8(dark, x[4]);
+  __m128i d8 = _mm_cmpgt_epi8(dark, x[8]), d12 = _mm_cmpgt_epi8(dark, x[12]);
+  __m128i maybe = _mm_or_si128(
+    _mm_or_si128(_mm_or_si128(_mm_and_si128(b0, b4), _mm_and_si128(b4, b8)),
+                 _mm_or_si128(_mm_and_si128(b8, b12), _mm_and_si128(b12, b0))),
+    _mm_or_si128(_mm_or_si128(_mm_and_si128(d0, d4), _mm_and_si128(d4, d8)),
+                 _mm_or_si128(_mm_and_si128(d8, d12), _mm_and_si128(d12, d0))));
+  if (!_mm_movemask_epi8(maybe)) return 0;
+
+  // longest run of brighter and of darker pixels around the circle, one counter per lane
+  __m128i run_b = _mm_setzero_si128(), run_d = _mm_setzero_si128();
+  __m128i max_run = _mm_setzero_si128();
+  for (int k = 0; k < 16 + 8; k++) {
+    __m128i mb = _mm_cmpgt_epi8(x[k % 16], bright), md = _mm_cmpgt_epi8(dark, x[k % 16]);
+    run_b = _mm_and_si128(_mm_sub_epi8(run_b, mb), mb);    // +1 where set, reset to 0 elsewhere
+    run_d = _mm_and_si128(_mm_sub_epi8(run_d, md), md);
+    max_run = _mm_max_epu8(max_run, _mm_max_epu8(run_b, run_d));
+  }
+  return _mm_movemask_epi8(_mm_cmpgt_epi8(max_run, _mm_set1_epi8(8)));
+}
+
+/**
+ * FAST corners of one cell at threshold t, suppressed to 3x3 local maxima of the score
+ * the one pixel ring around the cell is scored too, so suppression is consistent across cell borders
+ */
+void DetectCell(const cv::Mat &img, const int *circle, int x0, int y0, int x1, int y1, int t,
+                vector<cv::KeyPoint> &corners) {
+  const int ex0 = max(3, x0 - 1), ey0 = max(3, y0 - 1);
+  const int ex1 = min(img.cols - 3, x1 + 1), ey1 = min(img.rows - 3, y1 + 1);
+  const int w = ex1 - ex0;
+  if (w <= 0 || ey1 <= ey0) return;
+  vector<int> score((ey1 - ey0) * w, 0);
+  for (int y = ey0; y < ey1; y++) {
+    const uchar *row = img.ptr<uchar>(y);
+    int *score_row = &score[(y - ey0) * w];
+    int x = ex0;
+    for (; x + 16 <= ex1; x += 16) {
+      for (int mask = FASTCorners16(row + x, circle, t); mask; mask &= mask - 1) {
+        int i = __builtin_ctz(mask);
+        score_row[x + i - ex0] = FASTScore(row + x + i, circle, t);
+      }
+    }
+    for (; x < ex1; x++)
+      if (IsFASTCorner(row + x, circle, t)) score_row[x - ex0] = FASTScore(row + x, circle, t);
+  }
+
+  // keep a corner unless a neighbor scores higher, or the same and comes first in raster order
+  corners.clear();
+  for (int y = max(y0, ey0); y < min(y1, ey1); y++) {
+    for (int x = max(x0, ex0); x < min(x1, ex1); x++) {
+      const int *s = &score[(y - ey0) * w + x - ex0];
+      if (!s[0]) continue;
+      bool is_max = true;
+      for (int dy = -1; dy <= 1 && is_max; dy++) {
+        if (y + dy < ey0 || y + dy >= ey1) continue;
+        for (int dx = -1; dx <= 1; dx++) {
+          if ((!dx && !dy) || x + dx < ex0 || x + dx >= ex1) continue;
+          int n = s[dy * w + dx];
+          bool before = dy < 0 || (dy == 0 && dx < 0);
+          if (n > s[0] || (n == s[0] && before)) {
+            is_max = false;
+            break;
+          }
+        }
+      }
+      if (is_max) corners.push_back(cv::KeyPoint(x, y, 7, -1, s[0]));
+    }
+  }
+}
+
+void DetectFAST(const cv::Mat &img, vector<cv::KeyPoint> &keypoints, int num_features, int cell_size, int border) {
+  int circle[16];
+  for (int k = 0; k < 16; k++) circle[k] = fast_circle[k][1] * int(img.step) + fast_circle[k][0];
+
+  border = max(border, 3);
+  const int cells_x = max(1, (img.cols - 2 * border) / cell_size);
+  const int cells_y = max(1, (img.rows - 2 * border) / cell_size);
+  const int quota = (num_features + cells_x * cells_y - 1) / (cells_x * cells_y);
+  // cells are stretched a little to cover the whole area inside the border
+  auto cell_x = [&](int cx) { return border + cx * (img.cols - 2 * border) / cells_x; };
+  auto cell_y = [&](int cy) { return border + cy * (img.rows - 2 * border) / cells_y; };
+
+  // rank of a keypoint inside its cell, the weakest ranks are dropped first to meet the budget
+  vector<vector<pair<int, cv::KeyPoint>>> stripes(cells_y);
+  cv::parallel_for_(cv::Range(0, cells_y), [&](const cv::Range &range) {
+    vector<cv::KeyPoint> corners;
+    for (int cy = range.start; cy < range.end; cy++) {
+      for (int cx = 0; cx < cells_x; cx++) {
+        for (int t : fast_thresholds) {
+          DetectCell(img, circle, cell_x(cx), cell_y(cy), cell_x(cx + 1), cell_y(cy + 1), t, corners);
+          if (int(corners.size()) >= quota) break;
+        }
+        sort(corners.begin(), corners.end(),
+             [](const cv::KeyPoint &a, const cv::KeyPoint &b) { return a.response > b.response; });
+        for (int i = 0; i < min<int>(quota, corners.size()); i++) stripes[cy].push_back(make_pair(i, corners[i]));
+      }
+    }
+  });
+
+  vector<pair<int, cv::KeyPoint>> all;
+  for (auto &stripe : stripes) all.insert(all.end(), stripe.begin(), stripe.end());
+  stable_sort(all.begin(), all.end(), [](const pair<int, cv::KeyPoint> &a, const pair<int, cv::KeyPoint> &b) {
+    return a.first < b.first || (a.first == b.first && a.second.response > b.second.response);
+  });
+  keypoints.clear();
+  for (int i = 0; i < min<int>(num_features, all.size()); i++) keypoints.push_back(all[i].second);
+}
+
 // -------------------------------------------------------------------------------------------------- //
 // ORB pattern
 int ORB_pattern[256 * 4] = {
@@ -339,80 +535,251 @@ int ORB_pattern[256 * 4] = {
   -1, -6, 0, -11/*mean (0.127148), correlation (0.547401)*/
 };
 
+// number of quantized orientations, each has its own rotated copy of the pattern
+const int angle_bins = 30;
+
+/**
+ * the pattern rotated to the center of every angle bin and converted to integer pixel offsets,
+ * so a keypoint only looks up its bin instead of rotating 512 points
+ */
+struct RotatedPattern {
+  int8_t dx[angle_bins][512], dy[angle_bins][512];
+  int radius = 0;   // largest offset in either direction
+
+  RotatedPattern() {
+    for (int bin = 0; bin < angle_bins; bin++) {
+      double theta = bin * 2 * M_PI / angle_bins;
+      float c = cos(theta), s = sin(theta);
+      for (int k = 0; k < 512; k++) {
+        float x = ORB_pattern[k * 2], y = ORB_pattern[k * 2 + 1];
+        // the pixel at the float position kp.pt + offset is read with the coordinates truncated, and kp.pt is
+        // integral, so that is the floor of the offset. an offset a float ulp below an integer becomes that
+        // integer once kp.pt is added, hence the small epsilon
+        dx[bin][k] = cvFloor(double(c * x - s * y) + 1e-5);
+        dy[bin][k] = cvFloor(double(s * x + c * y) + 1e-5);
+        radius = max(radius, max(abs(int(dx[bin][k])), abs(int(dy[bin][k]))));
+      }
+    }
+  }
+};
+
+/**
+ * intensity centroid moments over the 16x16 patch with top left (x - 8, y - 8), one row per SSE register
+ * same integer sums as adding dx * pixel and dy * pixel one by one
+ */
+inline void PatchMoments(const cv::Mat &img, int x, int y, int &m10, int &m01) {
+  const int half_patch_size = 8;
+  const __m128i zero = _mm_setzero_si128();
+  const __m128i dx_lo = _mm_setr_epi16(-8, -7, -6, -5, -4, -3, -2, -1);
+  const __m128i dx_hi = _mm_setr_epi16(0, 1, 2, 3, 4, 5, 6, 7);
+  __m128i m10_acc = zero;
+  m01 = 0;
+  for (int dy = -half_patch_size; dy < half_patch_size; ++dy) {
+    __m128i row = _mm_loadu_si128((const __m128i *) (img.ptr<uchar>(y + dy) + x - half_patch_size));
+    __m128i sad = _mm_sad_epu8(row, zero);    // row sum in two halves
+    m01 += dy * (_mm_cvtsi128_si32(sad) + _mm_extract_epi16(sad, 4));
+    m10_acc = _mm_add_epi32(m10_acc, _mm_madd_epi16(_mm_unpacklo_epi8(row, zero), dx_lo));
+    m10_acc = _mm_add_epi32(m10_acc, _mm_madd_epi16(_mm_unpackhi_epi8(row, zero), dx_hi));
+  }
+  m10_acc = _mm_add_epi32(m10_acc, _mm_shuffle_epi32(m10_acc, _MM_SHUFFLE(1, 0, 3, 2)));
+  m10_acc = _mm_add_epi32(m10_acc, _mm_shuffle_epi32(m10_acc, _MM_SHUFFLE(2, 3, 0, 1)));
+  m10 = _mm_cvtsi128_si32(m10_acc);
+}
+
 // compute the descriptor
 void ComputeORB(const cv::Mat &img, vector<cv::KeyPoint> &keypoints, vector<DescType> &descriptors) {
-  const int half_patch_size = 8;
-  const int half_boundary = 16;
-  int bad_points = 0;
-  for (auto &kp: keypoints) {
-    if (kp.pt.x < half_boundary || kp.pt.y < half_boundary ||
-        kp.pt.x >= img.cols - half_boundary || kp.pt.y >= img.rows - half_boundary) {
-      // outside
-      bad_points++;
-      descriptors.push_back({});
-      continue;
-    }
+  static const RotatedPattern pattern;
+  // every pattern offset is within [-radius, radius], so a keypoint needs radius pixels on each side
+  const int half_boundary = max(16, pattern.radius);
 
-    float m01 = 0, m10 = 0;
-    for (int dx = -half_patch_size; dx < half_patch_size; ++dx) {
-      for (int dy = -half_patch_size; dy < half_patch_size; ++dy) {
-        uchar pixel = img.at<uchar>(kp.pt.y + dy, kp.pt.x + dx);
-        m10 += dx * pixel;
-        m01 += dy * pixel;
+  // pattern offsets in bytes for this image
+  vector<int> offsets(angle_bins * 512);
+  for (int bin = 0; bin < angle_bins; bin++)
+    for (int k = 0; k < 512; k++)
+      offsets[bin * 512 + k] = pattern.dy[bin][k] * int(img.step) + pattern.dx[bin][k];
+
+  size_t first = descriptors.size();
+  descriptors.resize(first + keypoints.size());
+  cv::parallel_for_(cv::Range(0, keypoints.size()), [&](const cv::Range &range) {
+    alignas(16) uchar p[32], q[32];
+    for (int i = range.start; i < range.end; i++) {
+      const cv::KeyPoint &kp = keypoints[i];
+      if (kp.pt.x < half_boundary || kp.pt.y < half_boundary ||
+          kp.pt.x > img.cols - 1 - half_boundary || kp.pt.y > img.rows - 1 - half_boundary) {
+        // outside, left as empty
+        continue;
       }
-    }
+      const int x = kp.pt.x, y = kp.pt.y;
+
+      int m10, m01;
+      PatchMoments(img, x, y, m10, m01);
 
-    // angle should be arc tan(m01/m10);
-    float m_sqrt = sqrt(m01 * m01 + m10 * m10) + 1e-18; // avoid divide by zero
-    float sin_theta = m01 / m_sqrt;
-    float cos_theta = m10 / m_sqrt;
-
-    // compute the angle of this point
-    DescType desc(8, 0);
-    for (int i = 0; i < 8; i++) {
-      uint32_t d = 0;
-      for (int k = 0; k < 32; k++) {
-        int idx_pq = i * 32 + k;
-        cv::Point2f p(ORB_pattern[idx_pq * 4], ORB_pattern[idx_pq * 4 + 1]);
-        cv::Point2f q(ORB_pattern[idx_pq * 4 + 2], ORB_pattern[idx_pq * 4 + 3]);
-
-        // rotate with theta
-        cv::Point2f pp = cv::Point2f(cos_theta * p.x - sin_theta * p.y, sin_theta * p.x + cos_theta * p.y)
-                         + kp.pt;
-        cv::Point2f qq = cv::Point2f(cos_theta * q.x - sin_theta * q.y, sin_theta * q.x + cos_theta * q.y)
-                         + kp.pt;
-        if (img.at<uchar>(pp.y, pp.x) < img.at<uchar>(qq.y, qq.x)) {
-          d |= 1 << k;
+      // angle is arc tan(m01/m10), rounded to the nearest bin
+      double theta = atan2(double(m01), double(m10));
+      int bin = cvRound(theta * angle_bins / (2 * M_PI));
+      bin = (bin % angle_bins + angle_bins) % angle_bins;
+      const int *offset = &offsets[bin * 512];
+      const uchar *center = img.ptr<uchar>(y) + x;
+
+      // bit k is set if p_k < q_k, compared 16 pairs at a time
+      DescType desc(8, 0);
+      for (int w = 0; w < 8; w++) {
+        for (int k = 0; k < 32; k++) {
+          p[k] = center[offset[(w * 32 + k) * 2]];
+          q[k] = center[offset[(w * 32 + k) * 2 + 1]];
+        }
+        for (int half = 0; half < 2; half++) {
+          __m128i a = _mm_load_si128((const __m128i *) (p + half * 16));
+          __m128i b = _mm_load_si128((const __m128i *) (q + half * 16));
+          // a >= b exactly where max(a, b) == a
+          uint32_t ge = _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_max_epu8(a, b), a));
+          desc[w] |= (~ge & 0xffff) << (half * 16);
         }
       }
-      desc[i] = d;
+      descriptors[first + i] = desc;
     }
-    descriptors.push_back(desc);
-  }
+  });
 
+  int bad_points = 0;
+  for (size_t i = first; i < descriptors.size(); i++)
+    if (descriptors[i].empty()) bad_points++;
   cout << "bad/total: " << bad_points << "/" << keypoints.size() << endl;
 }
 
 // brute-force matching
-void BfMatch(const vector<DescType> &desc1, const vector<DescType> &desc2, vector<cv::DMatch> &matches) {
-  const int d_max = 40;
+// descriptors are packed back to back into 4 x 64 bits, empty ones are skipped
+struct PackedDescriptors {
+  vector<uint64_t> bits;
+  vector<int> index;    // position in the original vector
 
-  for (size_t i1 = 0; i1 < desc1.size(); ++i1) {
-    if (desc1[i1].empty()) continue;
-    cv::DMatch m{i1, 0, 256};
-    for (size_t i2 = 0; i2 < desc2.size(); ++i2) {
-      if (desc2[i2].empty()) continue;
-      int distance = 0;
-      for (int k = 0; k < 8; k++) {
-        distance += _mm_popcnt_u32(desc1[i1][k] ^ desc2[i2][k]);
-      }
-      if (distance < d_max && distance < m.distance) {
-        m.distance = distance;
-        m.trainIdx = i2;
-      }
+  explicit PackedDescriptors(const vector<DescType> &desc) {
+    for (size_t i = 0; i < desc.size(); i++) {
+      if (desc[i].empty()) continue;
+      for (int k = 0; k < 8; k += 2)
+        bits.push_back(uint64_t(desc[i][k]) | uint64_t(desc[i][k + 1]) << 32);
+      index.push_back(i);
+    }
+  }
+
+  int size() const { return index.size(); }
+  const uint64_t *row(int i) const { return &bits[i * 4]; }
+};
+
+// best and second best distance of one query, ties keep the first train descriptor like a plain scan
+struct BestTwo {
+  int best = 256, second = 256, idx = -1;
+
+  void update(int d, int j) {
+    if (d < best) {
+      second = best;
+      best = d;
+      idx = j;
+    } else if (d < second) {
+      second = d;
     }
-    if (m.distance < d_max) {
-      matches.push_back(m);
+  }
+};
+
+inline int HammingDistance(const uint64_t *a, const uint64_t *b) {
+  return _mm_popcnt_u64(a[0] ^ b[0]) + _mm_popcnt_u64(a[1] ^ b[1]) +
+         _mm_popcnt_u64(a[2] ^ b[2]) + _mm_popcnt_u64(a[3] ^ b[3]);
+}
+
+/// distances from query to train[0..n), 4 train descriptors per step, n % 4 == 0
+typedef void (*DistanceKernel)(const uint64_t *query, const uint64_t *train, int n, int *dist);
+
+void DistancesScalar(const uint64_t *query, const uint64_t *train, int n, int *dist) {
+  for (int j = 0; j < n; j++) dist[j] = HammingDistance(query, train + j * 4);
+}
+
+/// popcount of q ^ t in four 64 bit lanes: a nibble lookup per byte, then sad adds the bytes
+__attribute__((target("avx2"))) inline __m256i PopcountXorAVX2(__m256i q, const uint64_t *t) {
+  const __m256i lut = _mm256_setr_epi8(0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4,
+                                       0, 1, 1, 2, 1, 2, 2, 3, 1, 2, 2, 3, 2, 3, 3, 4);
+  const __m256i low_mask = _mm256_set1_epi8(0x0f);
+  __m256i x = _mm256_xor_si256(q, _mm256_loadu_si256((const __m256i *) t));
+  __m256i c = _mm256_add_epi8(_mm256_shuffle_epi8(lut, _mm256_and_si256(x, low_mask)),
+                              _mm256_shuffle_epi8(lut, _mm256_and_si256(_mm256_srli_epi16(x, 4), low_mask)));
+  return _mm256_sad_epu8(c, _mm256_setzero_si256());
+}
+
+__attribute__((target("avx2"))) void DistancesAVX2(const uint64_t *query, const uint64_t *train, int n, int *dist) {
+  const __m256i q = _mm256_loadu_si256((const __m256i *) query);
+  for (int j = 0; j < n; j += 4) {
+    const uint64_t *t = train + j * 4;
+    // put the four partial sums of descriptor k into 32 bit lane k, then add the halves
+    __m256i a = _mm256_or_si256(PopcountXorAVX2(q, t), _mm256_slli_epi64(PopcountXorAVX2(q, t + 4), 32));
+    __m256i b = _mm256_or_si256(PopcountXorAVX2(q, t + 8), _mm256_slli_epi64(PopcountXorAVX2(q, t + 12), 32));
+    __m256i s = _mm256_add_epi32(_mm256_unpacklo_epi64(a, b), _mm256_unpackhi_epi64(a, b));
+    __m128i d = _mm_add_epi32(_mm256_castsi256_si128(s), _mm256_extracti128_si256(s, 1));
+    _mm_storeu_si128((__m128i *) (dist + j), d);
+  }
+}
+
+__attribute__((target("avx512f,avx512vpopcntdq")))
+void DistancesAVX512(const uint64_t *query, const uint64_t *train, int n, int *dist) {
+  // two train descriptors per register, the query is repeated in both halves
+  const __m512i q = _mm512_broadcast_i64x4(_mm256_loadu_si256((const __m256i *) query));
+  for (int j = 0; j < n; j += 4) {
+    const uint64_t *t = train + j * 4;
+    __m512i c01 = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(t)));
+    __m512i c23 = _mm512_popcnt_epi64(_mm512_xor_si512(q, _mm512_loadu_si512(t + 8)));
+    // descriptor k owns lanes 4k..4k+3, sum them with two in-register reductions
+    __m512i s = _mm512_add_epi64(_mm512_unpacklo_epi64(c01, c23), _mm512_unpackhi_epi64(c01, c23));
+    s = _mm512_add_epi64(s, _mm512_shuffle_i64x2(s, s, _MM_SHUFFLE(2, 3, 0, 1)));
+    // lanes 0, 1, 4, 5 now hold descriptors 0, 2, 1, 3
+    alignas(64) int64_t r[8];
+    _mm512_store_si512(r, s);
+    dist[j] = r[0];
+    dist[j + 1] = r[4];
+    dist[j + 2] = r[1];
+    dist[j + 3] = r[5];
+  }
+}
+
+/**
+ * best two matches in train for every query
+ * queries are split into blocks over threads, train is walked in tiles that stay in L1 for a whole query block
+ */
+void MatchBestTwo(const PackedDescriptors &query, const PackedDescriptors &train, vector<BestTwo> &result) {
+  static const DistanceKernel kernel =
+    __builtin_cpu_supports("avx512vpopcntdq") ? DistancesAVX512 :
+    __builtin_cpu_supports("avx2") ? DistancesAVX2 : DistancesScalar;
+  const int query_block = 32, train_tile = 256;   // a tile is 8 KB
+
+  result.assign(query.size(), BestTwo());
+  const int blocks = (query.size() + query_block - 1) / query_block;
+  cv::parallel_for_(cv::Range(0, blocks), [&](const cv::Range &range) {
+    int dist[train_tile];
+    for (int b = range.start; b < range.end; b++) {
+      const int q_end = min(query.size(), (b + 1) * query_block);
+      for (int t0 = 0; t0 < train.size(); t0 += train_tile) {
+        const int n = min(train_tile, train.size() - t0);
+        const int n4 = n / 4 * 4;
+        for (int i = b * query_block; i < q_end; i++) {
+          kernel(query.row(i), train.row(t0), n4, dist);
+          for (int j = n4; j < n; j++) dist[j] = HammingDistance(query.row(i), train.row(t0 + j));
+          for (int j = 0; j < n; j++) result[i].update(dist[j], t0 + j);
+        }
+      }
     }
+  });
+}
+
+void BfMatch(const vector<DescType> &desc1, const vector<DescType> &desc2, vector<cv::DMatch> &matches,
+             float ratio, bool cross_check) {
+  const int d_max = 40;
+
+  PackedDescriptors packed1(desc1), packed2(desc2);
+  vector<BestTwo> forward, backward;
+  MatchBestTwo(packed1, packed2, forward);
+  if (cross_check) MatchBestTwo(packed2, packed1, backward);
+
+  for (int i = 0; i < packed1.size(); i++) {
+    const BestTwo &m = forward[i];
+    if (m.best >= d_max) continue;
+    if (ratio < 1 && m.best >= ratio * m.second) continue;
+    if (cross_check && backward[m.idx].idx != i) continue;
+    matches.push_back(cv::DMatch(packed1.index[i], packed2.index[m.idx], m.best));
   }
-}
\ No newline at end of file
+}
@@ -14,6 +14,7 @@
 #include <g2o/solvers/dense/linear_solver_dense.h>
 #include <sophus/se3.h>
 #include <chrono>
+#include "image_sampling.h"
 
 using namespace std;
 using namespace cv;
@@ -330,8 +331,7 @@ public:
     Eigen::Vector3d pos_pixel = _K * (T * _pos3d);
     pos_pixel /= pos_pixel[2];
     // _error = _measurement - pos_pixel.head<2>();
-    _error(0, 0) = _measurement - getPixelValue(pos_pixel[0], pos_pixel[1]);
-    // cout << "error " << _measurement << " " << getPixelValue(pos_pixel[0], pos_pixel[1]) << endl;
+    _error(0, 0) = _measurement - slambook::sampleBilinear(*_gray_img, pos_pixel[0], pos_pixel[1]);
   }
 
   virtual void linearizeOplus() override {
@@ -355,8 +355,11 @@ public:
     jacobian_uv_ksai << -fx / Z, 0, fx * X / Z2, fx * X * Y / Z2, -fx - fx * X * X / Z2, fx * Y / Z,
       0, -fy / Z, fy * Y / (Z * Z), fy + fy * Y * Y / Z2, -fy * X * Y / Z2, -fy * X / Z;
 
-    jacobian_pixel_uv( 0,0 ) = (getPixelValue(img_u+1, img_v)-getPixelValue(img_u-1, img_v)) / 2;
-    jacobian_pixel_uv( 0,1 ) = (getPixelValue(img_u, img_v+1)-getPixelValue(img_u, img_v-1)) / 2;
+    // 3x3 窗口里取中心点左右上下的插值
+    float window[9];
+    slambook::sampleWindow(*_gray_img, img_u - 1, img_v - 1, 3, 3, window);
+    jacobian_pixel_uv( 0,0 ) = (window[5] - window[3]) / 2;
+    jacobian_pixel_uv( 0,1 ) = (window[7] - window[1]) / 2;
     _jacobianOplusXi = jacobian_pixel_uv*jacobian_uv_ksai;
   }
 
@@ -364,43 +367,12 @@ public:
 
   virtual bool write(ostream &out) const override {}
 
-  // get a gray scale value from reference image (bilinear interpolated)
-  inline float getPixelValue ( float x, float y )
-  {
-
-      // return float(_gray_img->ptr<uchar>(int(y))[int(x)]);
-      uchar* data = & _gray_img->data[ int ( y ) * _gray_img->step + int ( x ) ];
-      float xx = x - floor ( x );
-      float yy = y - floor ( y );
-      return float (
-                  ( 1-xx ) * ( 1-yy ) * data[0] +
-                  xx* ( 1-yy ) * data[1] +
-                  ( 1-xx ) *yy*data[_gray_img->step ] +
-                  xx*yy*data[_gray_img->step+1]
-              );
-  }
-
 private:
   Eigen::Vector3d _pos3d;
   Eigen::Matrix3d _K;
   cv::Mat* _gray_img = nullptr;    // reference image
 };
 
-float getPixelValue ( float x, float y, cv::Mat* img)
-{
-
-    // return float(_gray_img->ptr<uchar>(int(y))[int(x)]);
-    uchar* data = &img->data[ int ( y ) * img->step + int ( x ) ];
-    float xx = x - floor ( x );
-    float yy = y - floor ( y );
-    return float (
-                ( 1-xx ) * ( 1-yy ) * data[0] +
-                xx* ( 1-yy ) * data[1] +
-                ( 1-xx ) *yy*data[img->step ] +
-                xx*yy*data[img->step+1]
-            );
-}
-
 void bundleAdjustmentG2O(
   const VecVector3d &points_3d,
   const VecVector2d &points_2d,
@@ -466,7 +438,7 @@ void bundleAdjustmentG2O(
     EdgeProjectionDirect *edge = new EdgeProjectionDirect(p3d, K_eigen, img2);
     edge->setId(index_direct);
     edge->setVertex(0, vertex_pose_direct);
-    edge->setMeasurement(getPixelValue(float(p2d[0]), float(p2d[1]), img1));
+    edge->setMeasurement(slambook::sampleBilinear(*img1, float(p2d[0]), float(p2d[1])));
     edge->setInformation(Eigen::Matrix<double, 1, 1>::Identity());
     optimizer_direct.addEdge(edge);
     index_direct++;
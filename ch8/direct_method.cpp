@@ -2,6 +2,11 @@
 #include <sophus/se3.hpp>
 #include <boost/format.hpp>
 #include <pangolin/pangolin.h>
+#include "image_sampling.h"
+#include "image_pyramid.h"
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
 
 using namespace std;
 
@@ -12,6 +17,8 @@ typedef vector<Eigen::Vector2d, Eigen::aligned_allocator<Eigen::Vector2d>> VecVe
 // double fx = 278.708, fy = 278.657, cx = 169.431, cy = 124.534; // event camera
 double fx = 637.27803366, fy = 637.30526147, cx = 636.3285782, cy = 377.00039794; // rgbd camera
 int cols, rows;
+// pyramids of the last two images used by DirectPoseEstimationMultiLayer
+slambook::PyramidCache pyramid_cache(4);
 // baseline
 double baseline = 0.573;
 int huber_threshold = 8;
@@ -37,29 +44,21 @@ public:
         const cv::Mat &img2_,
         const VecVector2d &px_ref_,
         const vector<double> depth_ref_,
-        vector<bool> &outlier_,
-        Sophus::SE3d &T21_) :
-        img1(img1_), img2(img2_), px_ref(px_ref_), depth_ref(depth_ref_), outlier(outlier_), T21(T21_) {
+        Sophus::SE3d &T21_,
+        int border_ = 0) :
+        img1(img1_), img2(img2_), px_ref(px_ref_), depth_ref(depth_ref_), T21(T21_), border(border_) {
         projection = VecVector2d(px_ref.size(), Eigen::Vector2d(0, 0));
         projection_outlier = VecVector2d(px_ref.size(), Eigen::Vector2d(0, 0));
+        precompute_reference();
     }
 
-    JacobianAccumulator(
-        const cv::Mat &img1_,
-        const cv::Mat &img2_,
-        const VecVector2d &px_ref_,
-        const vector<double> depth_ref_,
-        vector<bool> &outlier_,
-        vector<double> &outlier_cost_,
-        Sophus::SE3d &T21_) :
-        img1(img1_), img2(img2_), px_ref(px_ref_), depth_ref(depth_ref_), outlier(outlier_), outlier_cost(outlier_cost_), T21(T21_) {
-        projection = VecVector2d(px_ref.size(), Eigen::Vector2d(0, 0));
-        projection_outlier = VecVector2d(px_ref.size(), Eigen::Vector2d(0, 0));
-    }
-
-    /// accumulate jacobians in a range
-    void accumulate_jacobian(const cv::Range &range);
-    void compute_outlier(const cv::Range &range);
+    /**
+     * one pass over all points: residuals and outlier classification at the current T21, with the
+     * jacobians precomputed on the reference image (inverse compositional, update T21 by T21 * exp(update)^-1)
+     * the points are split into fixed chunks, each chunk sums into its own H, b and cost,
+     * and the chunks are added up in order at the end, so no lock is needed and the result is deterministic
+     */
+    void accumulate();
 
     /// get hessian matrix
     Matrix6d hessian() const { return H; }
@@ -74,30 +73,122 @@ public:
     VecVector2d projected_points() const { return projection; }
     VecVector2d projected_outlier_points() const { return projection_outlier; }
 
-    /// reset h, b, cost to zero
-    void reset() {
-        H = Matrix6d::Zero();
-        b = Vector6d::Zero();
-        cost = 0;
-    }
+    static const int half_patch_size = 1;
+    static const int patch_size = 2 * half_patch_size + 1;
+    static const int patch_area = patch_size * patch_size;
 
 private:
+    /// partial sums of one chunk
+    struct ChunkSums {
+        Matrix6d H = Matrix6d::Zero();      // only the upper triangle is accumulated
+        Vector6d b = Vector6d::Zero();
+        double cost = 0;
+        int cnt_good = 0;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    /**
+     * the reference side does not change across iterations: back-projected points, patch intensities and,
+     * since the jacobians are taken on the reference image, the jacobian of every patch pixel
+     */
+    void precompute_reference();
+
+    /// accumulate the points in [begin, end) into sums
+    void accumulate_range(size_t begin, size_t end, ChunkSums &sums);
+
     const cv::Mat &img1;
     const cv::Mat &img2;
     const VecVector2d &px_ref;
     const vector<double> depth_ref;
-    vector<bool> outlier;
-    vector<double> outlier_cost;
     Sophus::SE3d &T21;
+    int border = 0;     // width of the replicated border around both images
     VecVector2d projection; // projected points
     VecVector2d projection_outlier; // projected points
 
-    std::mutex hessian_mutex;
+    vector<Eigen::Vector3d, Eigen::aligned_allocator<Eigen::Vector3d>> point_ref;  // points in the reference frame
+    vector<float> ref_patches;      // patch_area intensities per point
+    vector<Vector6d, Eigen::aligned_allocator<Vector6d>> ref_jacobians;    // patch_area jacobians per point
+
     Matrix6d H = Matrix6d::Zero();
     Vector6d b = Vector6d::Zero();
     double cost = 0;
 };
 
+/**
+ * sliding window photometric bundle adjustment over the last few keyframes, a much simplified DSO back end.
+ * each selected pixel of a keyframe is a point parameterized by its inverse depth in that (host) keyframe,
+ * with 3x3 patch residuals in every other keyframe of the window and a prior from the measured depth.
+ * poses and inverse depths are refined jointly by Gauss-Newton; the inverse depths are eliminated with the
+ * Schur complement, so only a 6N x 6N system is solved.
+ * when the window is full, the oldest keyframe and its points are marginalized into a prior on the remaining poses
+ */
+class PhotometricWindow {
+public:
+    PhotometricWindow(int max_keyframes_ = 5) : max_keyframes(max_keyframes_) {}
+
+    /// add a keyframe with its selected pixels and measured depths, marginalize the oldest one if the window is full
+    void add_keyframe(const cv::Mat &img, const VecVector2d &pixels, const vector<double> &depths,
+                      const Sophus::SE3d &T_cw);
+
+    /// joint Gauss-Newton iterations over all poses and inverse depths in the window
+    void optimize(int iterations);
+
+    /// pose (T_cw) of the newest keyframe
+    Sophus::SE3d latest_pose() const { return keyframes.back().T_cw; }
+
+private:
+    static const int half_patch_size = 1;
+    static const int patch_size = 2 * half_patch_size + 1;
+    static const int patch_area = patch_size * patch_size;
+
+    struct Keyframe {
+        cv::Mat img;
+        Sophus::SE3d T_cw, T_cw_backup;
+        EIGEN_MAKE_ALIGNED_OPERATOR_NEW
+    };
+
+    struct Point {
+        int host;           // index of the host keyframe in the window
+        double u, v;        // pixel in the host keyframe
+        float patch[patch_area];    // host intensities
+        double idepth, idepth_prior, idepth_backup;
+    };
+
+    /// normal equations of a set of points, with their inverse depths already eliminated
+    struct Reduced {
+        Eigen::MatrixXd H;
+        Eigen::VectorXd b;
+        double cost = 0;
+    };
+
+    /**
+     * linearize the residuals of the given points at the current state and eliminate their inverse depths
+     * @param lambda damping added to each inverse depth
+     * @param hdd, bd, hpd if not null, receive the per point blocks needed for back substitution,
+     *        hpd has one column per point
+     */
+    void linearize(const vector<int> &point_ids, double lambda, Reduced &reduced,
+                   vector<double> *hdd, vector<double> *bd, Eigen::MatrixXd *hpd) const;
+
+    /// add the marginalization prior, evaluated at the current poses
+    void add_prior(Reduced &reduced) const;
+
+    /// marginalize the oldest keyframe and the points it hosts
+    void marginalize_oldest();
+
+    int max_keyframes;
+    vector<Keyframe, Eigen::aligned_allocator<Keyframe>> keyframes;
+    vector<Point> points;
+
+    // prior from marginalization, linearized at prior_T
+    Eigen::MatrixXd prior_H;
+    Eigen::VectorXd prior_b;
+    vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d>> prior_T;
+
+    const double depth_prior_weight = 1e4;     // information of the measured inverse depth
+    const double idepth_lambda = 1e-4;         // damping of the inverse depths
+};
+
 /**
  * pose estimation using direct method
  * @param img1
@@ -121,36 +212,151 @@ void DirectPoseEstimationMultiLayer(
  * @param px_ref
  * @param depth_ref
  * @param T21
+ * @param border width of the replicated border around img1 and img2, e.g. of a pyramid level
  */
 void DirectPoseEstimationSingleLayer(
     const cv::Mat &img1,
     const cv::Mat &img2,
     const VecVector2d &px_ref,
     const vector<double> depth_ref,
-    Sophus::SE3d &T21
+    Sophus::SE3d &T21,
+    int border = 0
 );
 
-// bilinear interpolation
-inline float GetPixelValue(const cv::Mat &img, float x, float y) {
-    // boundary check
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
-    if (x >= img.cols) x = img.cols - 1;
-    if (y >= img.rows) y = img.rows - 1;
-    uchar *data = &img.data[int(y) * img.step + int(x)];
-    float xx = x - floor(x);
-    float yy = y - floor(y);
-    return float(
-        (1 - xx) * (1 - yy) * data[0] +
-        xx * (1 - yy) * data[1] +
-        (1 - xx) * yy * data[img.step] +
-        xx * yy * data[img.step + 1]
-    );
+/**
+ * squared gradient magnitude gx^2 + gy^2 by central differences (not halved)
+ * @param img CV_8UC1
+ * @param grad2 CV_32SC1, the one pixel border is set to 0
+ */
+void computeGradientMagnitude(const cv::Mat &img, cv::Mat &grad2) {
+    grad2 = cv::Mat::zeros(img.rows, img.cols, CV_32SC1);
+    cv::parallel_for_(cv::Range(1, img.rows - 1), [&](const cv::Range &range) {
+        for (int y = range.start; y < range.end; y++) {
+            const uchar *up = img.ptr<uchar>(y - 1), *row = img.ptr<uchar>(y), *down = img.ptr<uchar>(y + 1);
+            int *out = grad2.ptr<int>(y);
+            int x = 1;
+#ifdef __AVX2__
+            // 16 pixels per step: interleave (gx, gy) as int16 pairs, then madd gives gx^2 + gy^2 in int32
+            for (; x + 17 <= img.cols; x += 16) {
+                auto load16 = [](const uchar *p) {
+                    return _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *) p));
+                };
+                __m256i gx = _mm256_sub_epi16(load16(row + x + 1), load16(row + x - 1));
+                __m256i gy = _mm256_sub_epi16(load16(down + x), load16(up + x));
+                __m256i lo = _mm256_unpacklo_epi16(gx, gy), hi = _mm256_unpackhi_epi16(gx, gy);
+                lo = _mm256_madd_epi16(lo, lo);     // pixels 0-3 | 8-11
+                hi = _mm256_madd_epi16(hi, hi);     // pixels 4-7 | 12-15
+                _mm256_storeu_si256((__m256i *) (out + x), _mm256_permute2x128_si256(lo, hi, 0x20));
+                _mm256_storeu_si256((__m256i *) (out + x + 8), _mm256_permute2x128_si256(lo, hi, 0x31));
+            }
+#endif
+            for (; x < img.cols - 1; x++) {
+                int gx = row[x + 1] - row[x - 1], gy = down[x] - up[x];
+                out[x] = gx * gx + gy * gy;
+            }
+            out[img.cols - 1] = 0;
+        }
+    });
+}
+
+/**
+ * select about num_points pixels with large gradient, following the point selection of DSO:
+ * each 32x32 block gets a threshold from the median of its gradient histogram (smoothed over the
+ * neighbouring blocks), and in each cell of a regular grid only the strongest pixel above the threshold is kept.
+ * the cell size is adapted until the count is close to num_points, so the points are spread over the image
+ * and the cost of tracking is predictable
+ * @param grad2 squared gradient magnitude from computeGradientMagnitude
+ * @param valid extra test of a candidate pixel, e.g. whether it has a depth
+ * @param border pixels closer than this to the image border are not selected
+ */
+template<typename Valid>
+void selectPixels(const cv::Mat &grad2, int num_points, int border, Valid valid, vector<cv::Point> &selected) {
+    const int block = 32, hist_bins = 100;
+    const int threshold_add = 14;   // added to the block median, 7 in DSO which halves the differences
+    const int bw = (grad2.cols + block - 1) / block, bh = (grad2.rows + block - 1) / block;
+
+    // median gradient of each block
+    vector<float> median(bw * bh);
+    cv::parallel_for_(cv::Range(0, bw * bh), [&](const cv::Range &range) {
+        for (int b = range.start; b < range.end; b++) {
+            int hist[hist_bins] = {0}, count = 0;
+            const int x0 = (b % bw) * block, y0 = (b / bw) * block;
+            for (int y = y0; y < min(y0 + block, grad2.rows); y++)
+                for (int x = x0; x < min(x0 + block, grad2.cols); x++, count++)
+                    hist[min(hist_bins - 1, int(sqrt(float(grad2.at<int>(y, x)))))]++;
+            int bin = 0;
+            for (int sum = hist[0]; sum < count / 2; sum += hist[++bin]);
+            median[b] = bin;
+        }
+    });
+    vector<int> threshold2(bw * bh);    // squared threshold after 3x3 smoothing
+    for (int by = 0; by < bh; by++)
+        for (int bx = 0; bx < bw; bx++) {
+            float sum = 0;
+            int n = 0;
+            for (int dy = -1; dy <= 1; dy++)
+                for (int dx = -1; dx <= 1; dx++) {
+                    int nx = bx + dx, ny = by + dy;
+                    if (nx < 0 || ny < 0 || nx >= bw || ny >= bh) continue;
+                    sum += median[ny * bw + nx];
+                    n++;
+                }
+            float t = sum / n + threshold_add;
+            threshold2[by * bw + bx] = int(t * t);
+        }
+
+    // keep the strongest pixel of each cell
+    auto select = [&](int cell, vector<cv::Point> &out) {
+        const int cells_x = (grad2.cols - 2 * border + cell - 1) / cell;
+        const int cells_y = (grad2.rows - 2 * border + cell - 1) / cell;
+        vector<vector<cv::Point>> rows(cells_y);
+        cv::parallel_for_(cv::Range(0, cells_y), [&](const cv::Range &range) {
+            for (int cy = range.start; cy < range.end; cy++) {
+                const int y0 = border + cy * cell, y1 = min(y0 + cell, grad2.rows - border);
+                for (int cx = 0; cx < cells_x; cx++) {
+                    const int x0 = border + cx * cell, x1 = min(x0 + cell, grad2.cols - border);
+                    int best = 0;
+                    cv::Point best_px;
+                    for (int y = y0; y < y1; y++) {
+                        const int *g = grad2.ptr<int>(y);
+                        const int *t = &threshold2[(y / block) * bw];
+                        for (int x = x0; x < x1; x++)
+                            if (g[x] > best && g[x] > t[x / block] && valid(x, y)) {
+                                best = g[x];
+                                best_px = cv::Point(x, y);
+                            }
+                    }
+                    if (best > 0) rows[cy].push_back(best_px);
+                }
+            }
+        });
+        out.clear();
+        for (auto &r : rows) out.insert(out.end(), r.begin(), r.end());
+    };
+
+    // start from the cell size that would give num_points if every cell had one, then adapt
+    const double area = double(grad2.cols - 2 * border) * (grad2.rows - 2 * border);
+    int cell = max(1, int(sqrt(area / num_points)));
+    select(cell, selected);
+    for (int iter = 0; iter < 5 && !selected.empty(); iter++) {
+        double ratio = double(selected.size()) / num_points;
+        if (ratio > 0.9 && ratio < 1.1) break;
+        int new_cell = max(1, int(cell * sqrt(ratio) + 0.5));
+        if (new_cell == cell) new_cell = ratio > 1 ? cell + 1 : cell - 1;
+        if (new_cell < 1) break;
+        vector<cv::Point> candidate;
+        select(new_cell, candidate);
+        // stop when the count no longer moves towards the target
+        if (fabs(double(candidate.size()) - num_points) >= fabs(double(selected.size()) - num_points)) break;
+        cell = new_cell;
+        selected.swap(candidate);
+    }
 }
 
 // mode 0: random selection
-// mode 1: 
-void extractFeatures(cv::Mat& img, cv::Mat& disparity_img, VecVector2d& pixels_ref, vector<double>& depth_ref, int mode = 0) {
+// mode 1: pixels with large gradient, about num_points of them spread over the image
+void extractFeatures(cv::Mat& img, cv::Mat& disparity_img, VecVector2d& pixels_ref, vector<double>& depth_ref, int mode = 0,
+                     int num_points = 2000) {
     pixels_ref.clear();
     depth_ref.clear();
     cout << "mode = " << mode << endl;
@@ -178,22 +384,21 @@ void extractFeatures(cv::Mat& img, cv::Mat& disparity_img, VecVector2d& pixels_r
         }
         case 1: {
             cout << "mode 1" << endl;
-            // select the pixels with high gradiants 
-            for ( int x=1; x<img.cols-1; x+=3 ) {
-                for ( int y=1; y<img.rows-1; y+=3 ) {
-                    Eigen::Vector2d delta (
-                        img.ptr<uchar>(y)[x+1] - img.ptr<uchar>(y)[x-1], 
-                        img.ptr<uchar>(y+1)[x] - img.ptr<uchar>(y-1)[x]
-                    );
-
-                    if ( delta.norm() < 50 )
-                        continue;
-                    ushort disparity = disparity_img.at<ushort>(y, x);
-                    double depth = float(disparity) * 0.001;// you know this is disparity to depth
-                    if(depth < 0.3 || depth > 8) continue;
-                    depth_ref.push_back(depth);
-                    pixels_ref.push_back(Eigen::Vector2d(x, y));
-                }
+            // select the pixels with high gradiants
+            auto depth_at = [&](int x, int y) {
+                return float(disparity_img.at<ushort>(y, x)) * 0.001;   // you know this is disparity to depth
+            };
+            auto depth_valid = [&](int x, int y) {
+                double depth = depth_at(x, y);
+                return depth >= 0.3 && depth <= 8;
+            };
+            cv::Mat grad2;
+            computeGradientMagnitude(img, grad2);
+            vector<cv::Point> selected;
+            selectPixels(grad2, num_points, 4, depth_valid, selected);
+            for (auto &px : selected) {
+                depth_ref.push_back(depth_at(px.x, px.y));
+                pixels_ref.push_back(Eigen::Vector2d(px.x, px.y));
             }
             cout << "extracted " << depth_ref.size() << " featuers" << endl;
             break;
@@ -234,20 +439,29 @@ int main(int argc, char **argv) {
     // estimates 01~05.png's pose using this information
     Sophus::SE3d T_cur_ref;
 
+    // every third frame becomes a keyframe and is refined together with the previous ones
+    PhotometricWindow window(5);
+    window.add_keyframe(left_img, pixels_ref, depth_ref, Sophus::SE3d());
+
     for (int i = 700; i < 3500; i+=1) {  // 1~10
     // for (int i = 1; i < 6; i++) {  // 1~10
         // cv::Mat img = cv::imread((fmt_others % i).str(), 0);
         // cv::Mat img = cv::imread("../event"+std::to_string(i)+".png", 0);
         cv::Mat img = cv::imread((fmt_file % rgbd_dataset_path_ % 0 % i).str(), 0);
+        // DirectPoseEstimationMultiLayer(left_img, img, pixels_ref, depth_ref, T_cur_ref); // CHECK GUESS
+        // try single layer by uncomment this line
+        DirectPoseEstimationSingleLayer(left_img, img, pixels_ref, depth_ref, T_cur_ref);
         if (i % 3 == 0) {
+            // the tracked frame becomes the new reference and joins the window
+            Sophus::SE3d T_cur_w = T_cur_ref * window.latest_pose();
             left_img = img.clone();
             disparity_img = cv::imread((fmt_file % rgbd_dataset_path_ % 1 % i).str(), cv::IMREAD_UNCHANGED);
             extractFeatures(left_img, disparity_img, pixels_ref, depth_ref, 1);
-            continue;
+            window.add_keyframe(left_img, pixels_ref, depth_ref, T_cur_w);
+            window.optimize(5);
+            cout << "keyframe " << i << " T_cw = \n" << window.latest_pose().matrix() << endl;
+            T_cur_ref = Sophus::SE3d();
         }
-        // DirectPoseEstimationMultiLayer(left_img, img, pixels_ref, depth_ref, T_cur_ref); // CHECK GUESS
-        // try single layer by uncomment this line
-        DirectPoseEstimationSingleLayer(left_img, img, pixels_ref, depth_ref, T_cur_ref);
     }
     return 0;
 }
@@ -257,21 +471,17 @@ void DirectPoseEstimationSingleLayer(
     const cv::Mat &img2,
     const VecVector2d &px_ref,
     const vector<double> depth_ref,
-    Sophus::SE3d &T21) {
+    Sophus::SE3d &T21,
+    int border) {
 
     const int iterations = 4;
     double cost = 0, lastCost = 0;
     auto t1 = chrono::steady_clock::now();
-    vector<bool> outlier(px_ref.size(), false);
-    vector<double> outlier_cost(px_ref.size(), 0.0);
-    JacobianAccumulator jaco_accu(img1, img2, px_ref, depth_ref, outlier, T21);
-    JacobianAccumulator com_outlier(img1, img2, px_ref, depth_ref, outlier, outlier_cost, T21);
+    JacobianAccumulator jaco_accu(img1, img2, px_ref, depth_ref, T21, border);
 
     for (int iter = 0; iter < iterations; iter++) {
         auto t1 = std::chrono::steady_clock::now();
-        jaco_accu.reset();
-        cv::parallel_for_(cv::Range(0, px_ref.size()),
-                          std::bind(&JacobianAccumulator::accumulate_jacobian, &jaco_accu, std::placeholders::_1));
+        jaco_accu.accumulate();
         auto t2 = std::chrono::steady_clock::now();
         auto time_used =
             std::chrono::duration_cast<std::chrono::duration<double>>(t2 - t1);
@@ -282,8 +492,8 @@ void DirectPoseEstimationSingleLayer(
 
         // solve update and put it into estimation
         Vector6d update = H.ldlt().solve(b);
-        Sophus::SE3d T_cw_tmp = Sophus::SE3d::exp(update) * T21;
-        // T21 = Sophus::SE3d::exp(update) * T21;
+        // inverse compositional: the update moves the reference patch, so its inverse is applied to T21
+        Sophus::SE3d T_cw_tmp = T21 * Sophus::SE3d::exp(update).inverse();
         cost = jaco_accu.cost_func();
 
         if (std::isnan(update[0])) {
@@ -296,8 +506,6 @@ void DirectPoseEstimationSingleLayer(
             break;
         }
         T21 = T_cw_tmp;
-        cv::parallel_for_(cv::Range(0, px_ref.size()),
-                          std::bind(&JacobianAccumulator::compute_outlier, &com_outlier, std::placeholders::_1));
         if (update.norm() < 1e-3) {
             // converge
             break;
@@ -314,10 +522,12 @@ void DirectPoseEstimationSingleLayer(
     if ( rand() > RAND_MAX/5 ) {cout << "val = " << (float(rand())/RAND_MAX*100-50) << endl;}
 
     // plot the projected pixels here
+    // one more pass to classify and project the points at the final pose
+    jaco_accu.accumulate();
     cv::Mat img2_show;
     cv::cvtColor(img2, img2_show, cv::COLOR_GRAY2BGR);
-    VecVector2d projection = com_outlier.projected_points();
-    VecVector2d projection_outlier = com_outlier.projected_outlier_points();
+    VecVector2d projection = jaco_accu.projected_points();
+    VecVector2d projection_outlier = jaco_accu.projected_outlier_points();
     for (size_t i = 0; i < px_ref.size(); ++i) {
         auto p_ref = px_ref[i];
         auto p_cur = projection[i];
@@ -339,123 +549,78 @@ void DirectPoseEstimationSingleLayer(
     }
 }
 
-void JacobianAccumulator::accumulate_jacobian(const cv::Range &range) {
+void JacobianAccumulator::precompute_reference() {
+    const int window_size = patch_size + 2;
+    point_ref.resize(px_ref.size());
+    ref_patches.resize(px_ref.size() * patch_area);
+    ref_jacobians.resize(px_ref.size() * patch_area);
+    cv::parallel_for_(cv::Range(0, px_ref.size()), [&](const cv::Range &range) {
+        float window[window_size * window_size], grad_x[patch_area], grad_y[patch_area];
+        for (int i = range.start; i < range.end; i++) {
+            point_ref[i] = depth_ref[i] * Eigen::Vector3d((px_ref[i][0] - cx) / fx, (px_ref[i][1] - cy) / fy, 1);
+            // the reference patch with a one pixel border for the gradient
+            slambook::sampleWindow(img1, px_ref[i][0] - half_patch_size - 1, px_ref[i][1] - half_patch_size - 1,
+                                   window_size, window_size, window, border);
+            slambook::windowGradient(window, window_size, window_size, &ref_patches[i * patch_area],
+                                     grad_x, grad_y);
+
+            // the error is ref(exp(update) * P) - img2(T21 * P), its jacobian is taken at update = 0
+            double X = point_ref[i][0], Y = point_ref[i][1], Z_inv = 1.0 / point_ref[i][2], Z2_inv = Z_inv * Z_inv;
+            Matrix26d J_pixel_xi;
+            J_pixel_xi(0, 0) = fx * Z_inv;
+            J_pixel_xi(0, 1) = 0;
+            J_pixel_xi(0, 2) = -fx * X * Z2_inv;
+            J_pixel_xi(0, 3) = -fx * X * Y * Z2_inv;
+            J_pixel_xi(0, 4) = fx + fx * X * X * Z2_inv;
+            J_pixel_xi(0, 5) = -fx * Y * Z_inv;
+
+            J_pixel_xi(1, 0) = 0;
+            J_pixel_xi(1, 1) = fy * Z_inv;
+            J_pixel_xi(1, 2) = -fy * Y * Z2_inv;
+            J_pixel_xi(1, 3) = -fy - fy * Y * Y * Z2_inv;
+            J_pixel_xi(1, 4) = fy * X * Y * Z2_inv;
+            J_pixel_xi(1, 5) = fy * X * Z_inv;
+
+            for (int k = 0; k < patch_area; k++)
+                ref_jacobians[i * patch_area + k] =
+                    (grad_x[k] * J_pixel_xi.row(0) + grad_y[k] * J_pixel_xi.row(1)).transpose();
+        }
+    });
+}
 
-    // parameters
-    const int half_patch_size = 1;
+void JacobianAccumulator::accumulate() {
+    // fixed chunks, independent of the number of threads
+    const size_t chunk_size = 256;
+    const int chunks = (px_ref.size() + chunk_size - 1) / chunk_size;
+    vector<ChunkSums, Eigen::aligned_allocator<ChunkSums>> partial(chunks);
+    cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range) {
+        for (int c = range.start; c < range.end; c++)
+            accumulate_range(c * chunk_size, min(px_ref.size(), (c + 1) * chunk_size), partial[c]);
+    });
+
+    H = Matrix6d::Zero();
+    b = Vector6d::Zero();
+    double cost_sum = 0;
     int cnt_good = 0;
-    int cnt_outlier = 0;
-    Matrix6d hessian = Matrix6d::Zero();
-    Vector6d bias = Vector6d::Zero();
-    double cost_tmp = 0;
-    double cost_outlier = 0;
-    // std::cout << "cost_tmp = "<<cost_tmp<<std::endl;
-
-    for (size_t i = range.start; i < range.end; i++) {
-
-        if (outlier[i]) continue;
-        // compute the projection in the second image
-        Eigen::Vector3d point_ref =
-            depth_ref[i] * Eigen::Vector3d((px_ref[i][0] - cx) / fx, (px_ref[i][1] - cy) / fy, 1);
-        Eigen::Vector3d point_cur = T21 * point_ref;
-        if (point_cur[2] < 0)   // depth invalid
-            continue;
-
-        float u = fx * point_cur[0] / point_cur[2] + cx, v = fy * point_cur[1] / point_cur[2] + cy;
-        if (u < half_patch_size || u > img2.cols - half_patch_size || v < half_patch_size ||
-            v > img2.rows - half_patch_size)
-            continue;
-
-        // projection[i] = Eigen::Vector2d(u, v);
-        double X = point_cur[0], Y = point_cur[1], Z = point_cur[2],
-            Z2 = Z * Z, Z_inv = 1.0 / Z, Z2_inv = Z_inv * Z_inv;
-        cnt_good++;
-
-        // and compute error and jacobian
-        for (int x = -half_patch_size; x <= half_patch_size; x++)
-            for (int y = -half_patch_size; y <= half_patch_size; y++) {
-                // cout << "ixy = "<<i<<" "<<x<<" "<<y<<endl;
-
-                double error = GetPixelValue(img1, px_ref[i][0] + x, px_ref[i][1] + y) -
-                               GetPixelValue(img2, u + x, v + y);
-                // cout << "error before = " << error << endl;
-                // if ( rand() > RAND_MAX/5 ) {error = error + (float(rand())/RAND_MAX*100-50);}
-                // error = error + (float(rand())/RAND_MAX*400-200);
-                // outlier_cost[i] += error*error;
-                // cnt_outlier++;
-                float hw = fabs(error) < huber_threshold ? 1 : huber_threshold / fabs(error);
-                // cout << "error = after = " << error << "  hw = " << hw << endl;
-
-                Matrix26d J_pixel_xi;
-                Eigen::Vector2d J_img_pixel;
-
-                J_pixel_xi(0, 0) = fx * Z_inv;
-                J_pixel_xi(0, 1) = 0;
-                J_pixel_xi(0, 2) = -fx * X * Z2_inv;
-                J_pixel_xi(0, 3) = -fx * X * Y * Z2_inv;
-                J_pixel_xi(0, 4) = fx + fx * X * X * Z2_inv;
-                J_pixel_xi(0, 5) = -fx * Y * Z_inv;
-
-                J_pixel_xi(1, 0) = 0;
-                J_pixel_xi(1, 1) = fy * Z_inv;
-                J_pixel_xi(1, 2) = -fy * Y * Z2_inv;
-                J_pixel_xi(1, 3) = -fy - fy * Y * Y * Z2_inv;
-                J_pixel_xi(1, 4) = fy * X * Y * Z2_inv;
-                J_pixel_xi(1, 5) = fy * X * Z_inv;
-
-                J_img_pixel = Eigen::Vector2d(
-                    0.5 * (GetPixelValue(img2, u + 1 + x, v + y) - GetPixelValue(img2, u - 1 + x, v + y)),
-                    0.5 * (GetPixelValue(img2, u + x, v + 1 + y) - GetPixelValue(img2, u + x, v - 1 + y))
-                );
-
-                // total jacobian
-                Vector6d J = -1.0 * (J_img_pixel.transpose() * J_pixel_xi).transpose();
-
-                // hessian += J * J.transpose();
-                // bias += -error * J;
-                // cost_tmp += error * error;
-
-                hessian += J * J.transpose() * hw * hw;
-                bias += -error * J * hw * hw;
-                cost_tmp += hw * error * error * hw;
-                // cout << "error = " << error << endl;
-            }
-        // cost_outlier /= cnt_outlier;
-        // outlier_cost[i] /= cnt_outlier;
-        // if (cost_outlier > 100) {
-        //     outlier[i] = true;
-        // } else {
-        //     outlier[i] = false;
-        // }
-    }
-
-    if (cnt_good) {
-        // set hessian, bias and cost
-        // std::cout<<"cnt_good = "<<cnt_good<<std::endl;
-        unique_lock<mutex> lck(hessian_mutex);
-        H += hessian;
-        b += bias;
-        cost += cost_tmp / cnt_good;
+    for (auto &sums : partial) {
+        H += sums.H;
+        b += sums.b;
+        cost_sum += sums.cost;
+        cnt_good += sums.cnt_good;
     }
-    // std::cout<<"Finish optimization (direct) "<<std::endl;
+    H.triangularView<Eigen::StrictlyLower>() = H.transpose();
+    cost = cnt_good ? cost_sum / cnt_good : 0;
 }
 
-void JacobianAccumulator::compute_outlier(const cv::Range &range) {
+void JacobianAccumulator::accumulate_range(size_t begin, size_t end, ChunkSums &sums) {
+    const double outlier_threshold = 300;   // mean squared error of a patch
+    float curr_patch[patch_area];
+    double error[patch_area];
 
-    // parameters
-    const int half_patch_size = 1;
-    int cnt_good = 0;
-    int cnt_outlier = 0;
-    double cost_outlier = 0;
-    // projection.clear();
-
-    for (size_t i = range.start; i < range.end; i++) {
-
-        // if (outlier[i]) continue;
+    for (size_t i = begin; i < end; i++) {
         // compute the projection in the second image
-        Eigen::Vector3d point_ref =
-            depth_ref[i] * Eigen::Vector3d((px_ref[i][0] - cx) / fx, (px_ref[i][1] - cy) / fy, 1);
-        Eigen::Vector3d point_cur = T21 * point_ref;
+        Eigen::Vector3d point_cur = T21 * point_ref[i];
+        projection[i] = projection_outlier[i] = Eigen::Vector2d(0, 0);
         if (point_cur[2] <= 0)   // depth invalid
             continue;
 
@@ -464,34 +629,33 @@ void JacobianAccumulator::compute_outlier(const cv::Range &range) {
             v > img2.rows - half_patch_size)
             continue;
 
-        cnt_good++;
-        cost_outlier = 0;
-
-        // and compute error and jacobian
-        for (int x = -half_patch_size; x <= half_patch_size; x++)
-            for (int y = -half_patch_size; y <= half_patch_size; y++) {
-
-                double error = GetPixelValue(img1, px_ref[i][0] + x, px_ref[i][1] + y) -
-                               GetPixelValue(img2, u + x, v + y);
-                // cout << "error before = " << error << endl;
-                // if ( rand() > RAND_MAX/5 ) {error = error + (float(rand())/RAND_MAX*100-50);}
-                // error = error + (float(rand())/RAND_MAX*400-200);
-                // outlier_cost[i] += error*error;
-                cost_outlier += error * error;
-                cnt_outlier++;
-            }
-        cost_outlier /= cnt_outlier;
-        // outlier_cost[i] /= cnt_outlier;
-        if (cost_outlier > 300) {
-            outlier[i] = true;
-            projection[i] = Eigen::Vector2d(0, 0);
-            projection_outlier[i] = Eigen::Vector2d(u, v);
+        // only the intensities are needed in the second image, the jacobians come from the reference
+        slambook::sampleWindow(img2, u - half_patch_size, v - half_patch_size, patch_size, patch_size,
+                               curr_patch, border);
 
-        } else {
-            outlier[i] = false;
-            projection[i] = Eigen::Vector2d(u, v);
-            projection_outlier[i] = Eigen::Vector2d(0, 0);
-            // cout << " " << projection[i].transpose();
+        // residuals first, a patch with large error is an outlier and does not enter H
+        const float *ref_patch = &ref_patches[i * patch_area];
+        double patch_cost = 0;
+        for (int k = 0; k < patch_area; k++) {
+            error[k] = ref_patch[k] - curr_patch[k];
+            patch_cost += error[k] * error[k];
+        }
+        if (patch_cost / patch_area > outlier_threshold) {
+            projection_outlier[i] = Eigen::Vector2d(u, v);
+            continue;
+        }
+        projection[i] = Eigen::Vector2d(u, v);
+        sums.cnt_good++;
+
+        const Vector6d *J = &ref_jacobians[i * patch_area];
+        for (int k = 0; k < patch_area; k++) {
+            // huber weight
+            double hw = fabs(error[k]) < huber_threshold ? 1 : huber_threshold / fabs(error[k]);
+            double w = hw * hw;
+
+            sums.H.selfadjointView<Eigen::Upper>().rankUpdate(J[k], w);
+            sums.b += -error[k] * w * J[k];
+            sums.cost += w * error[k] * error[k];
         }
     }
 }
@@ -505,25 +669,11 @@ void DirectPoseEstimationMultiLayer(
 
     // parameters
     int pyramids = 4;
-    double pyramid_scale = 0.5;
     double scales[] = {1.0, 0.5, 0.25, 0.125};
 
-    // create pyramids
-    vector<cv::Mat> pyr1, pyr2; // image pyramids
-    for (int i = 0; i < pyramids; i++) {
-        if (i == 0) {
-            pyr1.push_back(img1);
-            pyr2.push_back(img2);
-        } else {
-            cv::Mat img1_pyr, img2_pyr;
-            cv::resize(pyr1[i - 1], img1_pyr,
-                       cv::Size(pyr1[i - 1].cols * pyramid_scale, pyr1[i - 1].rows * pyramid_scale));
-            cv::resize(pyr2[i - 1], img2_pyr,
-                       cv::Size(pyr2[i - 1].cols * pyramid_scale, pyr2[i - 1].rows * pyramid_scale));
-            pyr1.push_back(img1_pyr);
-            pyr2.push_back(img2_pyr);
-        }
-    }
+    // image pyramids, the reference image usually stays the same between calls and is built only once
+    const slambook::ImagePyramid &pyr1 = pyramid_cache.get(img1);
+    const slambook::ImagePyramid &pyr2 = pyramid_cache.get(img2);
 
     double fxG = fx, fyG = fy, cxG = cx, cyG = cy;  // backup the old values
     for (int level = pyramids - 1; level >= 0; level--) {
@@ -537,7 +687,257 @@ void DirectPoseEstimationMultiLayer(
         fy = fyG * scales[level];
         cx = cxG * scales[level];
         cy = cyG * scales[level];
-        DirectPoseEstimationSingleLayer(pyr1[level], pyr2[level], px_ref_pyr, depth_ref, T21);
+        DirectPoseEstimationSingleLayer(pyr1[level], pyr2[level], px_ref_pyr, depth_ref, T21, pyr1.borderWidth());
+    }
+
+}
+
+void PhotometricWindow::add_keyframe(const cv::Mat &img, const VecVector2d &pixels, const vector<double> &depths,
+                                     const Sophus::SE3d &T_cw) {
+    Keyframe kf;
+    kf.img = img;
+    kf.T_cw = kf.T_cw_backup = T_cw;
+    keyframes.push_back(kf);
+    const int host = keyframes.size() - 1;
+    for (size_t i = 0; i < pixels.size(); i++) {
+        if (depths[i] <= 0) continue;
+        Point pt;
+        pt.host = host;
+        pt.u = pixels[i][0];
+        pt.v = pixels[i][1];
+        slambook::sampleWindow(img, pt.u - half_patch_size, pt.v - half_patch_size, patch_size, patch_size, pt.patch);
+        pt.idepth = pt.idepth_prior = pt.idepth_backup = 1.0 / depths[i];
+        points.push_back(pt);
+    }
+
+    // the new pose is not constrained by the prior yet
+    const int n = 6 * keyframes.size();
+    prior_H.conservativeResize(n, n);
+    prior_b.conservativeResize(n);
+    prior_H.rightCols(6).setZero();
+    prior_H.bottomRows(6).setZero();
+    prior_b.tail(6).setZero();
+    prior_T.push_back(T_cw);
+    if (keyframes.size() == 1) {
+        // fix the gauge: the first keyframe stays where it is
+        prior_H.setIdentity();
+        prior_H *= 1e8;
+    }
+
+    if (int(keyframes.size()) > max_keyframes)
+        marginalize_oldest();
+}
+
+void PhotometricWindow::linearize(const vector<int> &point_ids, double lambda, Reduced &reduced,
+                                  vector<double> *hdd, vector<double> *bd, Eigen::MatrixXd *hpd) const {
+    const int nkf = keyframes.size(), np = 6 * nkf;
+    const int window_size = patch_size + 2;
+    if (hdd) {
+        hdd->assign(points.size(), 0);
+        bd->assign(points.size(), 0);
+        hpd->setZero(np, points.size());
     }
 
+    // relative poses and their rotations, T_th = T_t * T_h^-1
+    vector<Sophus::SE3d, Eigen::aligned_allocator<Sophus::SE3d>> T_th(nkf * nkf);
+    for (int t = 0; t < nkf; t++)
+        for (int h = 0; h < nkf; h++)
+            T_th[t * nkf + h] = keyframes[t].T_cw * keyframes[h].T_cw.inverse();
+
+    // points are split into fixed chunks, each reduces into its own system, then the chunks are added in order
+    const int chunk_size = 64;
+    const int chunks = (point_ids.size() + chunk_size - 1) / chunk_size;
+    vector<Reduced> partial(chunks);
+    cv::parallel_for_(cv::Range(0, chunks), [&](const cv::Range &range) {
+        float window[window_size * window_size], curr[patch_area], grad_x[patch_area], grad_y[patch_area];
+        Eigen::VectorXd hpd_j(np);
+        for (int c = range.start; c < range.end; c++) {
+            Reduced &sys = partial[c];
+            sys.H.setZero(np, np);
+            sys.b.setZero(np);
+            const int end = min<int>(point_ids.size(), (c + 1) * chunk_size);
+            for (int n = c * chunk_size; n < end; n++) {
+                const int j = point_ids[n];
+                const Point &pt = points[j];
+                const int h = pt.host;
+                const Eigen::Vector3d P_h = Eigen::Vector3d((pt.u - cx) / fx, (pt.v - cy) / fy, 1) / pt.idepth;
+                Eigen::Matrix<double, 3, 6> dPh_dxi;    // derivative of exp(xi) * P_h
+                dPh_dxi << Eigen::Matrix3d::Identity(), -Sophus::SO3d::hat(P_h);
+
+                double hdd_j = 0, bd_j = 0;
+                hpd_j.setZero();
+                for (int t = 0; t < nkf; t++) {
+                    if (t == h) continue;
+                    const Sophus::SE3d &T = T_th[t * nkf + h];
+                    const Eigen::Vector3d P_t = T * P_h;
+                    if (P_t[2] < 0.01) continue;
+                    const double Z_inv = 1.0 / P_t[2];
+                    const double u = fx * P_t[0] * Z_inv + cx, v = fy * P_t[1] * Z_inv + cy;
+                    if (u < window_size || u > cols - window_size || v < window_size || v > rows - window_size)
+                        continue;
+
+                    slambook::sampleWindow(keyframes[t].img, u - half_patch_size - 1, v - half_patch_size - 1,
+                                           window_size, window_size, window);
+                    slambook::windowGradient(window, window_size, window_size, curr, grad_x, grad_y);
+
+                    // chain rule from the pixel to the target pose, the host pose and the inverse depth
+                    Eigen::Matrix<double, 2, 3> du_dP;
+                    du_dP << fx * Z_inv, 0, -fx * P_t[0] * Z_inv * Z_inv,
+                        0, fy * Z_inv, -fy * P_t[1] * Z_inv * Z_inv;
+                    Eigen::Matrix<double, 3, 6> dPt_dxit;
+                    dPt_dxit << Eigen::Matrix3d::Identity(), -Sophus::SO3d::hat(P_t);
+                    const Eigen::Matrix3d R = T.rotationMatrix();
+                    const Matrix26d J_t = du_dP * dPt_dxit;
+                    const Matrix26d J_h = -du_dP * R * dPh_dxi;
+                    const Eigen::Vector2d J_rho = -du_dP * R * P_h / pt.idepth;
+
+                    Matrix6d H_tt = Matrix6d::Zero(), H_th = Matrix6d::Zero(), H_hh = Matrix6d::Zero();
+                    Vector6d b_t = Vector6d::Zero(), b_h = Vector6d::Zero(), c_t = Vector6d::Zero(),
+                        c_h = Vector6d::Zero();
+                    for (int k = 0; k < patch_area; k++) {
+                        const double r = curr[k] - pt.patch[k];
+                        const double hw = fabs(r) < huber_threshold ? 1 : huber_threshold / fabs(r);
+                        const Eigen::Vector2d g(grad_x[k], grad_y[k]);
+                        const Vector6d jt = J_t.transpose() * g, jh = J_h.transpose() * g;
+                        const double jr = g.dot(J_rho);
+                        H_tt.selfadjointView<Eigen::Upper>().rankUpdate(jt, hw);
+                        H_hh.selfadjointView<Eigen::Upper>().rankUpdate(jh, hw);
+                        H_th.noalias() += hw * jt * jh.transpose();
+                        b_t -= hw * r * jt;
+                        b_h -= hw * r * jh;
+                        c_t += hw * jr * jt;
+                        c_h += hw * jr * jh;
+                        hdd_j += hw * jr * jr;
+                        bd_j -= hw * r * jr;
+                        sys.cost += hw * r * r;
+                    }
+                    H_tt.triangularView<Eigen::StrictlyLower>() = H_tt.transpose();
+                    H_hh.triangularView<Eigen::StrictlyLower>() = H_hh.transpose();
+                    sys.H.block<6, 6>(6 * t, 6 * t) += H_tt;
+                    sys.H.block<6, 6>(6 * h, 6 * h) += H_hh;
+                    sys.H.block<6, 6>(6 * t, 6 * h) += H_th;
+                    sys.H.block<6, 6>(6 * h, 6 * t) += H_th.transpose();
+                    sys.b.segment<6>(6 * t) += b_t;
+                    sys.b.segment<6>(6 * h) += b_h;
+                    hpd_j.segment<6>(6 * t) += c_t;
+                    hpd_j.segment<6>(6 * h) += c_h;
+                }
+
+                // prior from the measured depth, it also keeps the scale
+                const double dr = pt.idepth - pt.idepth_prior;
+                hdd_j += depth_prior_weight + lambda;
+                bd_j -= depth_prior_weight * dr;
+                sys.cost += depth_prior_weight * dr * dr;
+
+                // eliminate the inverse depth
+                sys.H.selfadjointView<Eigen::Upper>().rankUpdate(hpd_j, -1.0 / hdd_j);
+                sys.b -= hpd_j * (bd_j / hdd_j);
+                if (hdd) {
+                    (*hdd)[j] = hdd_j;
+                    (*bd)[j] = bd_j;
+                    hpd->col(j) = hpd_j;
+                }
+            }
+        }
+    });
+
+    // rankUpdate only wrote the upper triangle of the Schur terms, the pose blocks are full
+    reduced.H.setZero(np, np);
+    reduced.b.setZero(np);
+    reduced.cost = 0;
+    for (auto &sys : partial) {
+        Eigen::MatrixXd upper = sys.H.triangularView<Eigen::Upper>();
+        reduced.H += upper;
+        reduced.b += sys.b;
+        reduced.cost += sys.cost;
+    }
+    reduced.H.triangularView<Eigen::StrictlyLower>() = reduced.H.transpose();
+}
+
+void PhotometricWindow::add_prior(Reduced &reduced) const {
+    // first order: the prior gradient moves with the distance from its linearization point
+    Eigen::VectorXd delta(prior_b.size());
+    for (size_t k = 0; k < keyframes.size(); k++)
+        delta.segment<6>(6 * k) = (keyframes[k].T_cw * prior_T[k].inverse()).log();
+    reduced.H += prior_H;
+    reduced.b += prior_b - prior_H * delta;
+    reduced.cost += delta.dot(prior_H * delta) - 2 * prior_b.dot(delta);
+}
+
+void PhotometricWindow::optimize(int iterations) {
+    auto t1 = chrono::steady_clock::now();
+    vector<int> all(points.size());
+    for (size_t j = 0; j < points.size(); j++) all[j] = j;
+
+    double last_cost = 0;
+    vector<double> hdd, bd;
+    Eigen::MatrixXd hpd;
+    for (int iter = 0; iter < iterations; iter++) {
+        Reduced sys;
+        linearize(all, idepth_lambda, sys, &hdd, &bd, &hpd);
+        add_prior(sys);
+
+        if (iter > 0 && sys.cost > last_cost) {
+            // the last step made things worse, go back
+            cout << "window cost increased: " << sys.cost << ", " << last_cost << endl;
+            for (auto &kf : keyframes) kf.T_cw = kf.T_cw_backup;
+            for (auto &pt : points) pt.idepth = pt.idepth_backup;
+            break;
+        }
+        last_cost = sys.cost;
+
+        // solve the reduced system for the poses, then back substitute the inverse depths
+        sys.H.diagonal().array() += 1e-6;
+        Eigen::VectorXd dx = sys.H.ldlt().solve(sys.b);
+        if (std::isnan(dx[0])) {
+            cout << "update is nan" << endl;
+            break;
+        }
+        for (size_t k = 0; k < keyframes.size(); k++) {
+            keyframes[k].T_cw_backup = keyframes[k].T_cw;
+            keyframes[k].T_cw = Sophus::SE3d::exp(dx.segment<6>(6 * k)) * keyframes[k].T_cw;
+        }
+        for (size_t j = 0; j < points.size(); j++) {
+            Point &pt = points[j];
+            pt.idepth_backup = pt.idepth;
+            pt.idepth = max(1e-3, pt.idepth + (bd[j] - hpd.col(j).dot(dx)) / hdd[j]);
+        }
+        cout << "window iteration: " << iter << ", cost: " << sys.cost << endl;
+        if (dx.norm() < 1e-4) break;
+    }
+    auto t2 = chrono::steady_clock::now();
+    auto time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+    cout << "sliding window with " << keyframes.size() << " keyframes and " << points.size()
+         << " points cost time: " << time_used.count() << endl;
+}
+
+void PhotometricWindow::marginalize_oldest() {
+    // the points hosted in the oldest keyframe go with it: eliminate their inverse depths,
+    // then eliminate the oldest pose from what is left together with the old prior
+    vector<int> hosted;
+    for (size_t j = 0; j < points.size(); j++)
+        if (points[j].host == 0) hosted.push_back(j);
+    Reduced sys;
+    linearize(hosted, 0, sys, nullptr, nullptr, nullptr);
+    add_prior(sys);
+
+    const int n = sys.H.rows() - 6;
+    Eigen::Matrix<double, 6, 6> H00 = sys.H.topLeftCorner<6, 6>();
+    H00.diagonal().array() += 1e-9;
+    const Eigen::Matrix<double, 6, 6> H00_inv = H00.inverse();
+    const Eigen::MatrixXd Hr0 = sys.H.bottomLeftCorner(n, 6);
+    prior_H = sys.H.bottomRightCorner(n, n) - Hr0 * H00_inv * Hr0.transpose();
+    prior_b = sys.b.tail(n) - Hr0 * H00_inv * sys.b.head<6>();
+    prior_T.clear();
+    for (size_t k = 1; k < keyframes.size(); k++) prior_T.push_back(keyframes[k].T_cw);
+
+    // residuals of the other points in the oldest keyframe are simply dropped
+    vector<Point> kept;
+    for (auto &pt : points) {
+        if (pt.host == 0) continue;
+        kept.push_back(pt);
+        kept.back().host--;
+    }
+    points.swap(kept);
+    keyframes.erase(keyframes.begin());
 }
@@ -7,6 +7,11 @@
 #include <chrono>
 #include <Eigen/Core>
 #include <Eigen/Dense>
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+#include "image_sampling.h"
+#include "image_pyramid.h"
 
 using namespace std;
 using namespace cv;
@@ -14,6 +19,9 @@ using namespace cv;
 string file_1 = "../LK1.png";  // first image
 string file_2 = "../LK2.png";  // second image
 
+// pyramids of the last two images, shared by the multi level and the dense flow
+slambook::PyramidCache pyramid_cache(4);
+
 /// Optical flow tracker and interface
 class OpticalFlowTracker {
 public:
@@ -23,9 +31,9 @@ public:
         const vector<KeyPoint> &kp1_,
         vector<KeyPoint> &kp2_,
         vector<bool> &success_,
-        bool inverse_ = true, bool has_initial_ = false) :
+        bool inverse_ = true, bool has_initial_ = false, int border_ = 0) :
         img1(img1_), img2(img2_), kp1(kp1_), kp2(kp2_), success(success_), inverse(inverse_),
-        has_initial(has_initial_) {}
+        has_initial(has_initial_), border(border_) {}
 
     void calculateOpticalFlow(const Range &range);
 
@@ -37,6 +45,7 @@ private:
     vector<bool> &success;
     bool inverse = true;
     bool has_initial = false;
+    int border = 0;     // width of the replicated border around both images
 };
 
 /**
@@ -47,6 +56,7 @@ private:
  * @param [in|out] kp2 keypoints in img2, if empty, use initial guess in kp1
  * @param [out] success true if a keypoint is tracked successfully
  * @param [in] inverse use inverse formulation?
+ * @param [in] border width of the replicated border around img1 and img2, e.g. of a pyramid level
  */
 void OpticalFlowSingleLevel(
     const Mat &img1,
@@ -55,7 +65,8 @@ void OpticalFlowSingleLevel(
     vector<KeyPoint> &kp2,
     vector<bool> &success,
     bool inverse = false,
-    bool has_initial_guess = false
+    bool has_initial_guess = false,
+    int border = 0
 );
 
 /**
@@ -78,29 +89,82 @@ void OpticalFlowMultiLevel(
 );
 
 /**
- * get a gray scale value from reference image (bi-linear interpolated)
- * @param img
- * @param x
- * @param y
- * @return the interpolated value of this pixel
+ * dense optical flow by inverse search: at every pyramid level a regular grid of overlapping patches is tracked
+ * with the same inverse compositional tracker, then the patch flows are blended into a per pixel flow field
+ * @param [in] img1 the first image
+ * @param [in] img2 the second image
+ * @param [out] flow CV_32FC2 flow field from img1 to img2
  */
+void OpticalFlowDense(
+    const Mat &img1,
+    const Mat &img2,
+    Mat &flow
+);
+
+// patch used by the tracker: 8x8 pixels, i.e. one AVX register per row
+const int half_patch_size = 4;
+const int patch_size = 2 * half_patch_size;
+const int patch_area = patch_size * patch_size;
+const int window_size = patch_size + 2;     // patch plus one pixel border for central differences
+
+/// sums over a patch for one Gauss-Newton step, with error = ref - curr and J = -grad
+struct PatchSums {
+    float bx = 0, by = 0;               // b = -error * J
+    float hxx = 0, hxy = 0, hyy = 0;    // H = J * J^T
+    float cost = 0;
+};
 
-inline float GetPixelValue(const cv::Mat &img, float x, float y) {
-    // boundary check
-    if (x < 0) x = 0;
-    if (y < 0) y = 0;
-    if (x >= img.cols - 1) x = img.cols - 2;
-    if (y >= img.rows - 1) y = img.rows - 2;
-    
-    float xx = x - floor(x);
-    float yy = y - floor(y);
-    int x_a1 = std::min(img.cols - 1, int(x) + 1);
-    int y_a1 = std::min(img.rows - 1, int(y) + 1);
-    
-    return (1 - xx) * (1 - yy) * img.at<uchar>(y, x)
-    + xx * (1 - yy) * img.at<uchar>(y, x_a1)
-    + (1 - xx) * yy * img.at<uchar>(y_a1, x)
-    + xx * yy * img.at<uchar>(y_a1, x_a1);
+#ifdef __AVX2__
+inline float HorizontalSum(__m256 v) {
+    __m128 s = _mm_add_ps(_mm256_castps256_ps128(v), _mm256_extractf128_ps(v, 1));
+    s = _mm_add_ps(s, _mm_movehl_ps(s, s));
+    s = _mm_add_ss(s, _mm_shuffle_ps(s, s, 1));
+    return _mm_cvtss_f32(s);
+}
+#endif
+
+/**
+ * accumulate b, cost and optionally H over a patch
+ * @param with_hessian also accumulate H, not needed in inverse mode where H is fixed
+ */
+inline PatchSums AccumulatePatch(const float *ref, const float *curr, const float *grad_x, const float *grad_y,
+                                 bool with_hessian) {
+    PatchSums sums;
+    int k = 0;
+#ifdef __AVX2__
+    __m256 bx = _mm256_setzero_ps(), by = _mm256_setzero_ps(), cost = _mm256_setzero_ps();
+    __m256 hxx = _mm256_setzero_ps(), hxy = _mm256_setzero_ps(), hyy = _mm256_setzero_ps();
+    for (; k + 8 <= patch_area; k += 8) {
+        __m256 e = _mm256_sub_ps(_mm256_load_ps(ref + k), _mm256_load_ps(curr + k));
+        __m256 gx = _mm256_load_ps(grad_x + k), gy = _mm256_load_ps(grad_y + k);
+        bx = slambook::mulAdd(e, gx, bx);
+        by = slambook::mulAdd(e, gy, by);
+        cost = slambook::mulAdd(e, e, cost);
+        if (with_hessian) {
+            hxx = slambook::mulAdd(gx, gx, hxx);
+            hxy = slambook::mulAdd(gx, gy, hxy);
+            hyy = slambook::mulAdd(gy, gy, hyy);
+        }
+    }
+    sums.bx = HorizontalSum(bx);
+    sums.by = HorizontalSum(by);
+    sums.cost = HorizontalSum(cost);
+    sums.hxx = HorizontalSum(hxx);
+    sums.hxy = HorizontalSum(hxy);
+    sums.hyy = HorizontalSum(hyy);
+#endif
+    for (; k < patch_area; k++) {
+        float e = ref[k] - curr[k];
+        sums.bx += e * grad_x[k];
+        sums.by += e * grad_y[k];
+        sums.cost += e * e;
+        if (with_hessian) {
+            sums.hxx += grad_x[k] * grad_x[k];
+            sums.hxy += grad_x[k] * grad_y[k];
+            sums.hyy += grad_y[k] * grad_y[k];
+        }
+    }
+    return sums;
 }
 
 int main(int argc, char **argv) {
@@ -140,6 +204,21 @@ int main(int argc, char **argv) {
     time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
     cout << "optical flow by opencv: " << time_used.count() << endl;
 
+    // dense flow over every pixel, compared with opencv's DIS flow
+    // the pyramids are built again inside the timing, as DIS has to build its own
+    Mat flow_dense, flow_cv;
+    pyramid_cache.clear();
+    t1 = chrono::steady_clock::now();
+    OpticalFlowDense(img1, img2, flow_dense);
+    t2 = chrono::steady_clock::now();
+    time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+    cout << "dense optical flow: " << time_used.count() << endl;
+    t1 = chrono::steady_clock::now();
+    cv::DISOpticalFlow::create(cv::DISOpticalFlow::PRESET_FAST)->calc(img1, img2, flow_cv);
+    t2 = chrono::steady_clock::now();
+    time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
+    cout << "dense optical flow by opencv: " << time_used.count() << endl;
+
     // plot the differences of those functions
     Mat img2_single;
     cv::cvtColor(img2, img2_single, cv::COLOR_GRAY2BGR);
@@ -167,10 +246,25 @@ int main(int argc, char **argv) {
             cv::line(img2_CV, pt1[i], pt2[i], cv::Scalar(0, 250, 0));
         }
     }
+    // dense flow: direction as hue, magnitude as brightness
+    auto flow_to_color = [](const Mat &flow) {
+        Mat channels[2], magnitude, angle;
+        cv::split(flow, channels);
+        cv::cartToPolar(channels[0], channels[1], magnitude, angle, true);
+        cv::normalize(magnitude, magnitude, 0, 255, cv::NORM_MINMAX);
+        Mat hsv[3] = {angle * 0.5, Mat::ones(angle.size(), CV_32F) * 255, magnitude}, hsv_img, bgr;
+        cv::merge(hsv, 3, hsv_img);
+        hsv_img.convertTo(hsv_img, CV_8U);
+        cv::cvtColor(hsv_img, bgr, cv::COLOR_HSV2BGR);
+        return bgr;
+    };
+
     std::cout << "imshow" << std::endl;
     cv::imshow("tracked single level", img2_single);
     cv::imshow("tracked multi level", img2_multi);
     cv::imshow("tracked by opencv", img2_CV);
+    cv::imshow("dense flow", flow_to_color(flow_dense));
+    cv::imshow("dense flow by opencv", flow_to_color(flow_cv));
     cv::waitKey(0);
 
     return 0;
@@ -182,18 +276,23 @@ void OpticalFlowSingleLevel(
     const vector<KeyPoint> &kp1,
     vector<KeyPoint> &kp2,
     vector<bool> &success,
-    bool inverse, bool has_initial) {
+    bool inverse, bool has_initial, int border) {
     kp2.resize(kp1.size());
     success.resize(kp1.size());
-    OpticalFlowTracker tracker(img1, img2, kp1, kp2, success, inverse, has_initial);
+    OpticalFlowTracker tracker(img1, img2, kp1, kp2, success, inverse, has_initial, border);
     parallel_for_(Range(0, kp1.size()),
                   std::bind(&OpticalFlowTracker::calculateOpticalFlow, &tracker, placeholders::_1));
 }
 
 void OpticalFlowTracker::calculateOpticalFlow(const Range &range) {
     // parameters
-    int half_patch_size = 4;
     int iterations = 10;
+
+    // per-thread buffers: the reference patch, its gradient and the sampled patch in img2
+    alignas(32) float window[window_size * window_size];
+    alignas(32) float ref[patch_area], curr[patch_area];
+    alignas(32) float grad_x[patch_area], grad_y[patch_area];
+
     for (size_t i = range.start; i < range.end; i++) {
         auto kp = kp1[i];
         double dx = 0, dy = 0; // dx,dy need to be estimated
@@ -205,51 +304,35 @@ void OpticalFlowTracker::calculateOpticalFlow(const Range &range) {
         double cost = 0, lastCost = 0;
         bool succ = true; // indicate if this point succeeded
 
+        // the reference patch does not change during the iterations, sample it only once.
+        // in inverse mode its gradient is the jacobian, so H is also fixed
+        slambook::sampleWindow(img1, kp.pt.x - half_patch_size - 1, kp.pt.y - half_patch_size - 1,
+                               window_size, window_size, window, border);
+        slambook::windowGradient(window, window_size, window_size, ref, grad_x, grad_y);
+
         // Gauss-Newton iterations
         Eigen::Matrix2d H = Eigen::Matrix2d::Zero();    // hessian
         Eigen::Vector2d b = Eigen::Vector2d::Zero();    // bias
-        Eigen::Vector2d J;  // jacobian
+        if (inverse) {
+            PatchSums sums = AccumulatePatch(ref, ref, grad_x, grad_y, true);
+            H << sums.hxx, sums.hxy, sums.hxy, sums.hyy;
+        }
         for (int iter = 0; iter < iterations; iter++) {
-            if (inverse == false) {
-                H = Eigen::Matrix2d::Zero();
-                b = Eigen::Vector2d::Zero();
+            // compute cost and jacobian
+            float x = kp.pt.x + dx - half_patch_size, y = kp.pt.y + dy - half_patch_size;
+            if (inverse) {
+                slambook::sampleWindow(img2, x, y, patch_size, patch_size, curr, border);
             } else {
-                // only reset b
-                b = Eigen::Vector2d::Zero();
+                // forward mode: J is the gradient of img2 at the current estimate
+                slambook::sampleWindow(img2, x - 1, y - 1, window_size, window_size, window, border);
+                slambook::windowGradient(window, window_size, window_size, curr, grad_x, grad_y);
+            }
+            PatchSums sums = AccumulatePatch(ref, curr, grad_x, grad_y, !inverse);
+            b = Eigen::Vector2d(sums.bx, sums.by);
+            cost = sums.cost;
+            if (!inverse) {
+                H << sums.hxx, sums.hxy, sums.hxy, sums.hyy;
             }
-
-            cost = 0;
-
-            // compute cost and jacobian
-            for (int x = -half_patch_size; x < half_patch_size; x++)
-                for (int y = -half_patch_size; y < half_patch_size; y++) {
-                    double error = GetPixelValue(img1, kp.pt.x + x, kp.pt.y + y) -
-                                   GetPixelValue(img2, kp.pt.x + x + dx, kp.pt.y + y + dy);;  // Jacobian
-                    if (inverse == false) {
-                        J = -1.0 * Eigen::Vector2d(
-                            0.5 * (GetPixelValue(img2, kp.pt.x + dx + x + 1, kp.pt.y + dy + y) -
-                                   GetPixelValue(img2, kp.pt.x + dx + x - 1, kp.pt.y + dy + y)),
-                            0.5 * (GetPixelValue(img2, kp.pt.x + dx + x, kp.pt.y + dy + y + 1) -
-                                   GetPixelValue(img2, kp.pt.x + dx + x, kp.pt.y + dy + y - 1))
-                        );
-                    } else if (iter == 0) {
-                        // in inverse mode, J keeps same for all iterations
-                        // NOTE this J does not change when dx, dy is updated, so we can store it and only compute error
-                        J = -1.0 * Eigen::Vector2d(
-                            0.5 * (GetPixelValue(img1, kp.pt.x + x + 1, kp.pt.y + y) -
-                                   GetPixelValue(img1, kp.pt.x + x - 1, kp.pt.y + y)),
-                            0.5 * (GetPixelValue(img1, kp.pt.x + x, kp.pt.y + y + 1) -
-                                   GetPixelValue(img1, kp.pt.x + x, kp.pt.y + y - 1))
-                        );
-                    }
-                    // compute H, b and set cost;
-                    b += -error * J;
-                    cost += error * error;
-                    if (inverse == false || iter == 0) {
-                        // also update H
-                        H += J * J.transpose();
-                    }
-                }
 
             // compute update
             Eigen::Vector2d update = H.ldlt().solve(b);
@@ -297,23 +380,10 @@ void OpticalFlowMultiLevel(
     double pyramid_scale = 0.5;
     double scales[] = {1.0, 0.5, 0.25, 0.125};
 
-    // create pyramids
+    // create pyramids, built only for images not seen in the last calls
     chrono::steady_clock::time_point t1 = chrono::steady_clock::now();
-    vector<Mat> pyr1, pyr2; // image pyramids
-    for (int i = 0; i < pyramids; i++) {
-        if (i == 0) {
-            pyr1.push_back(img1);
-            pyr2.push_back(img2);
-        } else {
-            Mat img1_pyr, img2_pyr;
-            cv::resize(pyr1[i - 1], img1_pyr,
-                       cv::Size(pyr1[i - 1].cols * pyramid_scale, pyr1[i - 1].rows * pyramid_scale));
-            cv::resize(pyr2[i - 1], img2_pyr,
-                       cv::Size(pyr2[i - 1].cols * pyramid_scale, pyr2[i - 1].rows * pyramid_scale));
-            pyr1.push_back(img1_pyr);
-            pyr2.push_back(img2_pyr);
-        }
-    }
+    const slambook::ImagePyramid &pyr1 = pyramid_cache.get(img1);
+    const slambook::ImagePyramid &pyr2 = pyramid_cache.get(img2);
     chrono::steady_clock::time_point t2 = chrono::steady_clock::now();
     auto time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
     cout << "build pyramid time: " << time_used.count() << endl;
@@ -331,7 +401,7 @@ void OpticalFlowMultiLevel(
         // from coarse to fine
         success.clear();
         t1 = chrono::steady_clock::now();
-        OpticalFlowSingleLevel(pyr1[level], pyr2[level], kp1_pyr, kp2_pyr, success, inverse, true);
+        OpticalFlowSingleLevel(pyr1[level], pyr2[level], kp1_pyr, kp2_pyr, success, inverse, true, pyr1.borderWidth());
         t2 = chrono::steady_clock::now();
         auto time_used = chrono::duration_cast<chrono::duration<double>>(t2 - t1);
         cout << "track pyr " << level << " cost time: " << time_used.count() << endl;
@@ -347,3 +417,106 @@ void OpticalFlowMultiLevel(
     for (auto &kp: kp2_pyr)
         kp2.push_back(kp);
 }
+
+/**
+ * blend the patch flows into a per pixel flow field. every pixel takes the average of the patches covering it,
+ * weighted by how well each patch flow explains this pixel: w = 1 / max(1, |I2(x + u) - I1(x)|)
+ * @param grid_x, grid_y top left corners of the patch columns and rows
+ * @param patch_flow flow of each patch, row major over the grid
+ */
+void DensifyFlow(const Mat &img1, const Mat &img2, const vector<int> &grid_x, const vector<int> &grid_y,
+                 const vector<Point2f> &patch_flow, Mat &flow) {
+    flow.create(img1.size(), CV_32FC2);
+    parallel_for_(Range(0, img1.rows), [&](const Range &range) {
+        vector<float> acc_u(img1.cols), acc_v(img1.cols), acc_w(img1.cols);
+        float xs[patch_size], ys[patch_size], warped[patch_size];
+        for (int y = range.start; y < range.end; y++) {
+            std::fill(acc_u.begin(), acc_u.end(), 0);
+            std::fill(acc_v.begin(), acc_v.end(), 0);
+            std::fill(acc_w.begin(), acc_w.end(), 0);
+            const uchar *row1 = img1.ptr<uchar>(y);
+            for (size_t r = 0; r < grid_y.size(); r++) {
+                if (y < grid_y[r] || y >= grid_y[r] + patch_size) continue;
+                for (size_t c = 0; c < grid_x.size(); c++) {
+                    const Point2f &f = patch_flow[r * grid_x.size() + c];
+                    const int x0 = grid_x[c];
+                    // one patch row has a single flow vector, the 8 warped samples are one gather
+                    for (int k = 0; k < patch_size; k++) {
+                        xs[k] = x0 + k + f.x;
+                        ys[k] = y + f.y;
+                    }
+                    slambook::gatherBilinear(img2, xs, ys, patch_size, warped);
+                    for (int k = 0; k < patch_size; k++) {
+                        float w = 1.0f / max(1.0f, fabs(warped[k] - row1[x0 + k]));
+                        acc_u[x0 + k] += w * f.x;
+                        acc_v[x0 + k] += w * f.y;
+                        acc_w[x0 + k] += w;
+                    }
+                }
+            }
+            Point2f *dst = flow.ptr<Point2f>(y);
+            for (int x = 0; x < img1.cols; x++) {
+                dst[x] = acc_w[x] > 0 ? Point2f(acc_u[x] / acc_w[x], acc_v[x] / acc_w[x]) : Point2f(0, 0);
+            }
+        }
+    });
+}
+
+void OpticalFlowDense(
+    const Mat &img1,
+    const Mat &img2,
+    Mat &flow) {
+
+    // parameters
+    int pyramids = 4;
+    double pyramid_scale = 0.5;
+    int patch_stride = 4;    // patches overlap by half
+
+    // image pyramids, built only for images not seen in the last calls
+    const slambook::ImagePyramid &pyr1 = pyramid_cache.get(img1);
+    const slambook::ImagePyramid &pyr2 = pyramid_cache.get(img2);
+
+    // coarse to fine, each level starts from the upsampled dense flow of the coarser one
+    Mat level_flow;
+    for (int level = pyramids - 1; level >= 0; level--) {
+        const Mat &im1 = pyr1[level], &im2 = pyr2[level];
+        Mat init_flow;
+        if (level == pyramids - 1) {
+            init_flow = Mat::zeros(im1.size(), CV_32FC2);
+        } else {
+            cv::resize(level_flow, init_flow, im1.size());
+            init_flow *= 1.0 / pyramid_scale;
+        }
+
+        // regular patch grid, the last row and column are moved in so the grid covers the whole image
+        vector<int> grid_x, grid_y;
+        for (int x = 0; x + patch_size <= im1.cols; x += patch_stride) grid_x.push_back(x);
+        for (int y = 0; y + patch_size <= im1.rows; y += patch_stride) grid_y.push_back(y);
+        if (grid_x.back() + patch_size < im1.cols) grid_x.push_back(im1.cols - patch_size);
+        if (grid_y.back() + patch_size < im1.rows) grid_y.push_back(im1.rows - patch_size);
+
+        // the tracker takes patch centers, initialized with the flow at the center
+        vector<KeyPoint> kp1, kp2;
+        vector<bool> success;
+        for (int y : grid_y) {
+            for (int x : grid_x) {
+                Point2f center(x + half_patch_size, y + half_patch_size);
+                Point2f f = init_flow.at<Point2f>(min<int>(center.y, im1.rows - 1), min<int>(center.x, im1.cols - 1));
+                kp1.push_back(KeyPoint(center, patch_size));
+                kp2.push_back(KeyPoint(center + f, patch_size));
+            }
+        }
+        OpticalFlowSingleLevel(im1, im2, kp1, kp2, success, true, true, pyr1.borderWidth());
+
+        // patches that failed or ran away keep their initial flow
+        vector<Point2f> patch_flow(kp1.size());
+        for (size_t i = 0; i < kp1.size(); i++) {
+            Point2f init = init_flow.at<Point2f>(min<int>(kp1[i].pt.y, im1.rows - 1),
+                                                 min<int>(kp1[i].pt.x, im1.cols - 1));
+            Point2f f = kp2[i].pt - kp1[i].pt;
+            patch_flow[i] = (success[i] && cv::norm(f - init) <= patch_size) ? f : init;
+        }
+        DensifyFlow(im1, im2, grid_x, grid_y, patch_flow, level_flow);
+    }
+    flow = level_flow;
+}
\ No newline at end of file
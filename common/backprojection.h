@@ -0,0 +1,185 @@
+#ifndef SLAMBOOK_BACKPROJECTION_H
+#define SLAMBOOK_BACKPROJECTION_H
+
+// RGB-D 深度图反投影，第五讲的 joinMap 和第十二讲的建图程序共用
+// 只依赖 OpenCV 和 Eigen，全部写在头文件里，直接 include 即可
+
+#include <vector>
+#include <opencv2/core/core.hpp>
+#include <Eigen/Geometry>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+namespace slambook {
+
+/**
+ * 每个像素的归一化平面坐标 (x, y, 1)，只与内参有关，对同一相机只需计算一次
+ * 反投影时乘以深度即可，不再需要逐像素做除法
+ */
+class RayTable {
+public:
+    RayTable(double fx, double fy, double cx, double cy, int cols, int rows)
+        : rows_(rows), cols_(cols), x_(rows * cols), y_(rows * cols) {
+        for (int v = 0; v < rows; v++)
+            for (int u = 0; u < cols; u++) {
+                x_[v * cols + u] = float((u - cx) / fx);
+                y_[v * cols + u] = float((v - cy) / fy);
+            }
+    }
+
+    int rows() const { return rows_; }
+
+    int cols() const { return cols_; }
+
+    const float *rayX(int v) const { return &x_[v * cols_]; }
+
+    const float *rayY(int v) const { return &y_[v * cols_]; }
+
+private:
+    int rows_, cols_;
+    std::vector<float> x_, y_;
+};
+
+/**
+ * 反投影得到的点，每个分量单独一个数组（SoA），预先分配好
+ * 每帧每个像素占一个位置，valid 为 0 表示这个像素没有测量到深度
+ */
+struct PointBuffer {
+    int frames = 0, rows = 0, cols = 0;
+    std::vector<float> x, y, z;
+    std::vector<uchar> b, g, r, valid;
+
+    void resize(int num_frames, int num_rows, int num_cols) {
+        frames = num_frames;
+        rows = num_rows;
+        cols = num_cols;
+        size_t n = size_t(frames) * rows * cols;
+        x.resize(n);
+        y.resize(n);
+        z.resize(n);
+        b.resize(n);
+        g.resize(n);
+        r.resize(n);
+        valid.resize(n);
+    }
+
+    /// index of the first pixel of frame i
+    size_t frameBegin(int i) const { return size_t(i) * rows * cols; }
+
+    size_t frameEnd(int i) const { return frameBegin(i + 1); }
+
+    /// number of valid points of frame i
+    size_t countValid(int i) const {
+        size_t n = 0;
+        for (size_t k = frameBegin(i); k < frameEnd(i); k++) n += valid[k];
+        return n;
+    }
+};
+
+/**
+ * 反投影一行像素并变换到世界坐标系
+ * 有 SSE2 时（x86-64 总是有）每次处理 8 个像素，与逐点计算的运算顺序相同
+ */
+inline void backProjectRow(const RayTable &rays, const cv::Mat &depth, const cv::Mat &color,
+                           float depth_scale_inv, const Eigen::Matrix3f &R, const Eigen::Vector3f &t,
+                           int v, PointBuffer &buffer, size_t begin) {
+    const unsigned short *d = depth.ptr<unsigned short>(v);
+    const float *rx = rays.rayX(v), *ry = rays.rayY(v);
+    float *px = &buffer.x[begin], *py = &buffer.y[begin], *pz = &buffer.z[begin];
+    uchar *valid = &buffer.valid[begin];
+    const float r00 = R(0, 0), r01 = R(0, 1), r02 = R(0, 2);
+    const float r10 = R(1, 0), r11 = R(1, 1), r12 = R(1, 2);
+    const float r20 = R(2, 0), r21 = R(2, 1), r22 = R(2, 2);
+    const float t0 = t[0], t1 = t[1], t2 = t[2];
+    const int cols = rays.cols();
+    int u = 0;
+#ifdef __SSE2__
+    const __m128 scale = _mm_set1_ps(depth_scale_inv);
+    const __m128 m00 = _mm_set1_ps(r00), m01 = _mm_set1_ps(r01), m02 = _mm_set1_ps(r02);
+    const __m128 m10 = _mm_set1_ps(r10), m11 = _mm_set1_ps(r11), m12 = _mm_set1_ps(r12);
+    const __m128 m20 = _mm_set1_ps(r20), m21 = _mm_set1_ps(r21), m22 = _mm_set1_ps(r22);
+    const __m128 v0 = _mm_set1_ps(t0), v1 = _mm_set1_ps(t1), v2 = _mm_set1_ps(t2);
+    const __m128i zero = _mm_setzero_si128(), one = _mm_set1_epi16(1);
+    for (; u + 8 <= cols; u += 8) {
+        const __m128i d16 = _mm_loadu_si128((const __m128i *) (d + u));
+        // 16 位深度扩展成两组 32 位整数再转成 float
+        const __m128 zs[2] = {_mm_mul_ps(_mm_cvtepi32_ps(_mm_unpacklo_epi16(d16, zero)), scale),
+                              _mm_mul_ps(_mm_cvtepi32_ps(_mm_unpackhi_epi16(d16, zero)), scale)};
+        for (int h = 0; h < 2; h++) {
+            const int k = u + 4 * h;
+            const __m128 z = zs[h];
+            const __m128 x = _mm_mul_ps(_mm_loadu_ps(rx + k), z), y = _mm_mul_ps(_mm_loadu_ps(ry + k), z);
+            _mm_storeu_ps(px + k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m00, x), _mm_mul_ps(m01, y)),
+                                                        _mm_mul_ps(m02, z)), v0));
+            _mm_storeu_ps(py + k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m10, x), _mm_mul_ps(m11, y)),
+                                                        _mm_mul_ps(m12, z)), v1));
+            _mm_storeu_ps(pz + k, _mm_add_ps(_mm_add_ps(_mm_add_ps(_mm_mul_ps(m20, x), _mm_mul_ps(m21, y)),
+                                                        _mm_mul_ps(m22, z)), v2));
+        }
+        // 深度不为 0 的像素记为 1，压成 8 个字节
+        const __m128i measured = _mm_andnot_si128(_mm_cmpeq_epi16(d16, zero), one);
+        _mm_storel_epi64((__m128i *) (valid + u), _mm_packus_epi16(measured, zero));
+    }
+#endif
+    for (; u < cols; u++) {
+        float z = d[u] * depth_scale_inv;
+        float x = rx[u] * z, y = ry[u] * z;
+        px[u] = r00 * x + r01 * y + r02 * z + t0;
+        py[u] = r10 * x + r11 * y + r12 * z + t1;
+        pz[u] = r20 * x + r21 * y + r22 * z + t2;
+        valid[u] = d[u] != 0;   // 为0表示没有测量到
+    }
+
+    // BGR 交错存储的颜色拆成三个数组
+    if (color.empty()) return;
+    const uchar *c = color.ptr<uchar>(v);
+    const int channels = color.channels();
+    for (int u = 0; u < cols; u++, c += channels) {
+        buffer.b[begin + u] = c[0];
+        buffer.g[begin + u] = c[channels > 1 ? 1 : 0];
+        buffer.r[begin + u] = c[channels > 2 ? 2 : 0];
+    }
+}
+
+/**
+ * 把一组 RGB-D 图像反投影到世界坐标系，按帧和行一起并行
+ * @param [in] rays 相机的归一化坐标表，尺寸需和深度图相同
+ * @param [in] depths CV_16UC1 深度图
+ * @param [in] colors 彩色图，可以为空
+ * @param [in] depth_scale 深度值除以它得到米
+ * @param [in] poses 每帧的相机位姿 T_wc，Eigen::Isometry3d 或 Sophus::SE3d 都可以
+ * @param [out] buffer 结果，尺寸不对时重新分配
+ */
+template<typename PoseVector>
+void backProjectFrames(const RayTable &rays, const std::vector<cv::Mat> &depths,
+                       const std::vector<cv::Mat> &colors, double depth_scale,
+                       const PoseVector &poses, PointBuffer &buffer) {
+    const int frames = depths.size(), rows = rays.rows(), cols = rays.cols();
+    if (buffer.frames != frames || buffer.rows != rows || buffer.cols != cols)
+        buffer.resize(frames, rows, cols);
+
+    std::vector<Eigen::Matrix3f> rotations(frames);
+    std::vector<Eigen::Vector3f> translations(frames);
+    for (int i = 0; i < frames; i++) {
+        CV_Assert(depths[i].type() == CV_16UC1 && depths[i].rows == rows && depths[i].cols == cols);
+        Eigen::Matrix4d T = poses[i].matrix();
+        rotations[i] = T.block<3, 3>(0, 0).cast<float>();
+        translations[i] = T.block<3, 1>(0, 3).cast<float>();
+    }
+
+    const float depth_scale_inv = float(1.0 / depth_scale);
+    cv::parallel_for_(cv::Range(0, frames * rows), [&](const cv::Range &range) {
+        for (int k = range.start; k < range.end; k++) {
+            int i = k / rows, v = k % rows;
+            cv::Mat color = i < int(colors.size()) ? colors[i] : cv::Mat();
+            backProjectRow(rays, depths[i], color, depth_scale_inv, rotations[i], translations[i], v,
+                           buffer, buffer.frameBegin(i) + size_t(v) * cols);
+        }
+    });
+}
+
+}  // namespace slambook
+
+#endif  // SLAMBOOK_BACKPROJECTION_H
@@ -0,0 +1,147 @@
+#ifndef SLAMBOOK_BINARY_INDEX_H
+#define SLAMBOOK_BINARY_INDEX_H
+
+// 256 位二进制描述子（ORB）的多索引哈希（multi-index hashing），用于在很大的描述子库里找最近邻
+// 描述子切成 16 段 16 位的子串，每段一张直接寻址的哈希表。两个描述子的距离不超过 r 时，
+// 至少有一段子串的距离不超过 r/16，所以只要在每张表里查子串附近的几个桶，不用和整个库比较
+// 哈希表是压缩存储的（CSR）：每张表的桶按顺序排好，编号连续放在一个数组里，另有一个数组记录每个桶的起点
+// 只依赖 OpenCV，全部写在头文件里
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <utility>
+#include <vector>
+#include <nmmintrin.h>
+#include <opencv2/core/core.hpp>
+
+namespace slambook {
+
+class MultiIndexHash {
+public:
+    static const int bytes = 32;                        // 描述子长度
+    static const int substrings = 16;                   // 子串个数，也是哈希表个数
+    static const int substring_bits = 16;
+    static const int buckets = 1 << substring_bits;
+
+    /// 加入一个描述子，返回它的编号（从 0 开始顺序编号）。哈希表在下一次搜索时才更新
+    int add(const uchar *desc) {
+        const int id = size();
+        bits.resize(bits.size() + 4);
+        memcpy(&bits[id * 4], desc, bytes);
+        return id;
+    }
+
+    /// 加入 CV_8UC1 的描述子矩阵，每行一个
+    void add(const cv::Mat &descriptors) {
+        for (int i = 0; i < descriptors.rows; i++) add(descriptors.ptr<uchar>(i));
+    }
+
+    int size() const { return bits.size() / 4; }
+
+    /**
+     * 把新加入的描述子放进哈希表，knnSearch 和 knnMatch 会先调用它
+     * 每次都按计数排序整个重建，加入和搜索交替进行时尽量成批加入。会修改哈希表，不能和搜索同时调用
+     */
+    void build() {
+        const int n = size();
+        if (n == indexed) return;
+        offsets.assign(substrings * buckets + 1, 0);
+        uint16_t keys[substrings];
+        for (int i = 0; i < n; i++) {
+            memcpy(keys, &bits[i * 4], bytes);
+            for (int j = 0; j < substrings; j++) offsets[j * buckets + keys[j] + 1]++;
+        }
+        for (size_t b = 1; b < offsets.size(); b++) offsets[b] += offsets[b - 1];
+        // 按编号顺序填入，每个桶里的编号是升序的
+        std::vector<int> next(offsets.begin(), offsets.end() - 1);
+        ids.resize(size_t(substrings) * n);
+        for (int i = 0; i < n; i++) {
+            memcpy(keys, &bits[i * 4], bytes);
+            for (int j = 0; j < substrings; j++) ids[next[j * buckets + keys[j]]++] = i;
+        }
+        indexed = n;
+    }
+
+    /**
+     * 距离不超过 radius 的 k 个最近邻，结果是精确的，按距离从小到大排列，距离相同时编号小的在前
+     * （与按编号顺序暴力搜索的结果相同）
+     * 子串距离从 0 开始逐级放宽，每级依次查 16 张表：第 s 级查到第 j 张表时，没找到的描述子前 j 段
+     * 至少差 s+1 位、其余至少差 s 位，距离不小于 16s+j，已经有 k 个更近的或者超过了 radius 就可以停止
+     * @param result trainIdx 为描述子编号，queryIdx 为 query_idx
+     */
+    void knnSearch(const uchar *query, int k, int radius, std::vector<cv::DMatch> &result,
+                   int query_idx = 0) {
+        build();
+        search(query, k, radius, result, query_idx);
+    }
+
+    /// 对 queries 的每一行做 knnSearch，按行并行
+    void knnMatch(const cv::Mat &queries, int k, int radius, std::vector<std::vector<cv::DMatch>> &matches) {
+        build();
+        matches.resize(queries.rows);
+        cv::parallel_for_(cv::Range(0, queries.rows), [&](const cv::Range &range) {
+            for (int i = range.start; i < range.end; i++) search(queries.ptr<uchar>(i), k, radius, matches[i], i);
+        });
+    }
+
+private:
+    /// knnSearch 的搜索部分，哈希表已经是最新的，可以并行调用
+    void search(const uchar *query, int k, int radius, std::vector<cv::DMatch> &result, int query_idx) const {
+        result.clear();
+        if (indexed == 0) return;
+        uint64_t q[4];
+        uint16_t keys[substrings];
+        memcpy(q, query, bytes);
+        memcpy(keys, query, bytes);
+        std::vector<std::pair<int, int>> best;     // (距离, 编号)，升序
+        const std::vector<std::vector<uint16_t>> &masks = masksByWeight();
+        for (int s = 0; s <= substring_bits; s++) {
+            for (int j = 0; j < substrings; j++) {
+                const int bound = s * substrings + j;   // 还没找到的描述子的距离下界
+                if (bound > radius || (int(best.size()) == k && best.back().first < bound)) {
+                    s = substring_bits;
+                    break;
+                }
+                for (uint16_t mask : masks[s]) {
+                    // 桶里的编号是连续存放的，几个描述子的读取可以同时进行
+                    const int bucket = j * buckets + (keys[j] ^ mask);
+                    for (int p = offsets[bucket]; p < offsets[bucket + 1]; p++) {
+                        const int id = ids[p];
+                        const uint64_t *d = &bits[id * 4];
+                        const int dist = _mm_popcnt_u64(q[0] ^ d[0]) + _mm_popcnt_u64(q[1] ^ d[1]) +
+                                         _mm_popcnt_u64(q[2] ^ d[2]) + _mm_popcnt_u64(q[3] ^ d[3]);
+                        if (dist > radius) continue;
+                        const std::pair<int, int> candidate(dist, id);
+                        if (int(best.size()) == k && !(candidate < best.back())) continue;
+                        // 同一个描述子可能在几张表里都被找到
+                        auto pos = std::lower_bound(best.begin(), best.end(), candidate);
+                        if (pos != best.end() && *pos == candidate) continue;
+                        best.insert(pos, candidate);
+                        if (int(best.size()) > k) best.pop_back();
+                    }
+                }
+            }
+        }
+        for (auto &b : best) result.push_back(cv::DMatch(query_idx, b.second, b.first));
+    }
+
+    /// 按 1 的个数分组的全部 16 位掩码，第 s 组用来查子串距离恰好为 s 的桶
+    static const std::vector<std::vector<uint16_t>> &masksByWeight() {
+        static const std::vector<std::vector<uint16_t>> masks = [] {
+            std::vector<std::vector<uint16_t>> m(substring_bits + 1);
+            for (int v = 0; v < buckets; v++) m[_mm_popcnt_u32(v)].push_back(v);
+            return m;
+        }();
+        return masks;
+    }
+
+    std::vector<uint64_t> bits;     // 描述子，每个 4 x 64 位
+    // 第 j 张表里子串为 key 的编号在 ids[offsets[j * buckets + key], offsets[j * buckets + key + 1])
+    std::vector<int> offsets, ids;
+    int indexed = 0;                // 已经放进哈希表的描述子个数
+};
+
+}  // namespace slambook
+
+#endif  // SLAMBOOK_BINARY_INDEX_H
@@ -0,0 +1,144 @@
+#ifndef SLAMBOOK_IMAGE_PYRAMID_H
+#define SLAMBOOK_IMAGE_PYRAMID_H
+
+// 灰度图金字塔，第八讲的光流和直接法共用
+// 每层缩小一半，用 2x2 块平均；每层四周留一圈复制边界的像素，
+// 把 borderWidth() 传给 sampleWindow，靠近边界的窗口也能直接读，不用逐点截断
+// 只依赖 OpenCV，全部写在头文件里；编译时打开了 AVX2（例如 -march=native）就用向量化的版本
+
+#include <cstring>
+#include <vector>
+#include <opencv2/core/core.hpp>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace slambook {
+
+/// 2x2 块平均的半采样，dst 为 (src.cols/2) x (src.rows/2)，每个像素为 (a+b+c+d+2)/4
+inline void halfSample(const cv::Mat &src, cv::Mat &dst) {
+    dst.create(src.rows / 2, src.cols / 2, CV_8UC1);
+    for (int y = 0; y < dst.rows; y++) {
+        const uchar *row0 = src.ptr<uchar>(2 * y), *row1 = src.ptr<uchar>(2 * y + 1);
+        uchar *out = dst.ptr<uchar>(y);
+        int x = 0;
+#ifdef __AVX2__
+        // 每次读两行各 32 个像素，maddubs 把相邻两个像素加成 16 位，再把两行相加
+        const __m256i ones = _mm256_set1_epi8(1), two = _mm256_set1_epi16(2);
+        for (; x + 16 <= dst.cols; x += 16) {
+            __m256i a = _mm256_loadu_si256((const __m256i *) (row0 + 2 * x));
+            __m256i b = _mm256_loadu_si256((const __m256i *) (row1 + 2 * x));
+            __m256i s = _mm256_add_epi16(_mm256_maddubs_epi16(a, ones), _mm256_maddubs_epi16(b, ones));
+            s = _mm256_srli_epi16(_mm256_add_epi16(s, two), 2);
+            // packus 在每个 128 位内交错，permute 之后低 128 位就是按顺序的 16 个结果
+            __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(s, s), 0xD8);
+            _mm_storeu_si128((__m128i *) (out + x), _mm256_castsi256_si128(packed));
+        }
+#endif
+        for (; x < dst.cols; x++)
+            out[x] = (row0[2 * x] + row0[2 * x + 1] + row1[2 * x] + row1[2 * x + 1] + 2) >> 2;
+    }
+}
+
+/// 用最外一圈像素填满 padded 四周宽 border 的边框
+inline void fillBorder(cv::Mat &padded, int border) {
+    const int cols = padded.cols - 2 * border, rows = padded.rows - 2 * border;
+    for (int y = border; y < border + rows; y++) {
+        uchar *row = padded.ptr<uchar>(y);
+        memset(row, row[border], border);
+        memset(row + border + cols, row[border + cols - 1], border);
+    }
+    for (int y = 0; y < border; y++) {
+        memcpy(padded.ptr<uchar>(y), padded.ptr<uchar>(border), padded.cols);
+        memcpy(padded.ptr<uchar>(border + rows + y), padded.ptr<uchar>(border + rows - 1), padded.cols);
+    }
+}
+
+/**
+ * 图像金字塔，第 0 层是原图的拷贝，之后每层缩小一半
+ * 每层都是一块带边框的内存中间的 ROI，读 ROI 外 border 以内的像素是安全的
+ */
+class ImagePyramid {
+public:
+    ImagePyramid(int levels = 4, int border = 16) : num_levels(levels), border(border) {}
+
+    /// img 为 CV_8UC1
+    void build(const cv::Mat &img) {
+        source = img;
+        buffers.resize(num_levels);
+        layers.resize(num_levels);
+        for (int i = 0; i < num_levels; i++) {
+            const int cols = i == 0 ? img.cols : layers[i - 1].cols / 2;
+            const int rows = i == 0 ? img.rows : layers[i - 1].rows / 2;
+            buffers[i].create(rows + 2 * border, cols + 2 * border, CV_8UC1);
+            layers[i] = buffers[i](cv::Rect(border, border, cols, rows));
+            if (i == 0) img.copyTo(layers[i]);
+            else halfSample(layers[i - 1], layers[i]);
+            fillBorder(buffers[i], border);
+        }
+    }
+
+    /// 是否由 img 这块图像数据建成。图像被原地改写过的话这里看不出来
+    bool isBuiltFrom(const cv::Mat &img) const {
+        return !source.empty() && source.data == img.data && source.step == img.step &&
+               source.size() == img.size();
+    }
+
+    /// 释放图像数据，之后 isBuiltFrom 对任何图像都返回 false
+    void clear() {
+        source.release();
+        buffers.clear();
+        layers.clear();
+    }
+
+    int levels() const { return num_levels; }
+
+    /// 每层四周复制边缘像素的边框宽度
+    int borderWidth() const { return border; }
+
+    const cv::Mat &operator[](int level) const { return layers[level]; }
+
+private:
+    int num_levels, border;
+    cv::Mat source;     // 持有原图，缓存期间这块内存不会被释放后分给别的图像
+    std::vector<cv::Mat> buffers, layers;
+};
+
+/**
+ * 最近用过的几个金字塔，按图像数据查找，没有的话替换最久没用的一个
+ * 顺序跟踪时上一次的第二帧就是这一次的第一帧，每帧的金字塔只建一次。不是线程安全的
+ */
+class PyramidCache {
+public:
+    PyramidCache(int levels = 4, int capacity = 2) : pyramids(capacity, ImagePyramid(levels)),
+                                                     last_used(capacity, 0) {}
+
+    const ImagePyramid &get(const cv::Mat &img) {
+        size_t oldest = 0;
+        for (size_t i = 0; i < pyramids.size(); i++) {
+            if (pyramids[i].isBuiltFrom(img)) {
+                last_used[i] = ++clock;
+                return pyramids[i];
+            }
+            if (last_used[i] < last_used[oldest]) oldest = i;
+        }
+        pyramids[oldest].build(img);
+        last_used[oldest] = ++clock;
+        return pyramids[oldest];
+    }
+
+    /// 清空缓存，之后每张图像都要重新建金字塔
+    void clear() {
+        for (auto &p : pyramids) p.clear();
+    }
+
+private:
+    std::vector<ImagePyramid> pyramids;
+    std::vector<long> last_used;
+    long clock = 0;
+};
+
+}  // namespace slambook
+
+#endif  // SLAMBOOK_IMAGE_PYRAMID_H
@@ -0,0 +1,147 @@
+#ifndef SLAMBOOK_IMAGE_SAMPLING_H
+#define SLAMBOOK_IMAGE_SAMPLING_H
+
+// 灰度图的双线性插值，第七讲、第八讲的直接法/光流和第十二讲的单目稠密建图共用
+// 图像外的像素统一取最近的边缘像素（复制边缘），坐标拉回到 [0, cols-1] x [0, rows-1]，
+// 与 ImagePyramid 用 fillBorder 填的边框相同，所以读带边框的金字塔和逐点截断的结果一样
+// 只依赖 OpenCV，全部写在头文件里；编译时打开了 AVX2（例如 -march=native）就用向量化的版本
+
+#include <algorithm>
+#include <cmath>
+#include <opencv2/core/core.hpp>
+
+#ifdef __AVX2__
+#include <immintrin.h>
+#endif
+
+namespace slambook {
+
+#ifdef __AVX2__
+/// a * b + c。AVX2 不一定带 FMA（例如只加了 -mavx2），没有的话分成乘和加两步
+inline __m256 mulAdd(__m256 a, __m256 b, __m256 c) {
+#ifdef __FMA__
+    return _mm256_fmadd_ps(a, b, c);
+#else
+    return _mm256_add_ps(_mm256_mul_ps(a, b), c);
+#endif
+}
+#endif
+
+/// 单点双线性插值，img 为 CV_8UC1，图像外按复制边缘像素处理
+inline float sampleBilinear(const cv::Mat &img, float x, float y) {
+    x = std::min(std::max(x, 0.0f), float(img.cols - 1));
+    y = std::min(std::max(y, 0.0f), float(img.rows - 1));
+    const int x0 = int(x), y0 = int(y);
+    // 落在最后一列（行）上时权重为 0 的邻居换成它自己，不越界读
+    const int dx = x0 + 1 < img.cols ? 1 : 0;
+    const float xx = x - x0, yy = y - y0;
+    const uchar *row0 = img.ptr<uchar>(y0) + x0;
+    const uchar *row1 = y0 + 1 < img.rows ? row0 + img.step : row0;
+    return (1 - xx) * (1 - yy) * row0[0] + xx * (1 - yy) * row0[dx] +
+           (1 - xx) * yy * row1[0] + xx * yy * row1[dx];
+}
+
+/**
+ * 批量插值 n 个任意位置的点，结果与逐点调用 sampleBilinear 相同（最多差浮点舍入）
+ * AVX2 下每 8 个点一组，用 gather 一次取出左右相邻的两个像素
+ */
+inline void gatherBilinear(const cv::Mat &img, const float *xs, const float *ys, int n, float *out) {
+    int i = 0;
+#ifdef __AVX2__
+    const __m256 zero = _mm256_setzero_ps();
+    const __m256 end_x = _mm256_set1_ps(img.cols - 1), end_y = _mm256_set1_ps(img.rows - 1);
+    const __m256i step = _mm256_set1_epi32(int(img.step));
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    // gather 每次读 4 个字节，下一行的读取不能超过最后一个像素。落在最后一列上的点右边的邻居权重为 0，
+    // 读到的是下一行开头（或行尾的空余），不影响结果
+    const __m256i last = _mm256_set1_epi32(int((img.rows - 1) * img.step + img.cols) - 4);
+    const int *base = (const int *) img.data;
+    for (; i + 8 <= n; i += 8) {
+        // 与 sampleBilinear 的截断相同：拉回到 [0, cols-1] x [0, rows-1]
+        __m256 x = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(xs + i), zero), end_x);
+        __m256 y = _mm256_min_ps(_mm256_max_ps(_mm256_loadu_ps(ys + i), zero), end_y);
+        __m256 x0 = _mm256_floor_ps(x), y0 = _mm256_floor_ps(y);
+        __m256 xx = _mm256_sub_ps(x, x0), yy = _mm256_sub_ps(y, y0);
+        __m256i idx0 = _mm256_add_epi32(_mm256_mullo_epi32(_mm256_cvttps_epi32(y0), step), _mm256_cvttps_epi32(x0));
+        __m256i idx1 = _mm256_add_epi32(idx0, step);
+        if (_mm256_movemask_epi8(_mm256_cmpgt_epi32(idx1, last))) {
+            // 靠近图像右下角的点，这一组逐点算
+            for (int k = i; k < i + 8; k++) out[k] = sampleBilinear(img, xs[k], ys[k]);
+            continue;
+        }
+        __m256i r0 = _mm256_i32gather_epi32(base, idx0, 1);
+        __m256i r1 = _mm256_i32gather_epi32(base, idx1, 1);
+        __m256 p00 = _mm256_cvtepi32_ps(_mm256_and_si256(r0, byte_mask));
+        __m256 p10 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(r0, 8), byte_mask));
+        __m256 p01 = _mm256_cvtepi32_ps(_mm256_and_si256(r1, byte_mask));
+        __m256 p11 = _mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(r1, 8), byte_mask));
+        __m256 top = mulAdd(xx, _mm256_sub_ps(p10, p00), p00);
+        __m256 bottom = mulAdd(xx, _mm256_sub_ps(p11, p01), p01);
+        _mm256_storeu_ps(out + i, mulAdd(yy, _mm256_sub_ps(bottom, top), top));
+    }
+#endif
+    for (; i < n; i++) out[i] = sampleBilinear(img, xs[i], ys[i]);
+}
+
+/**
+ * 取左上角在 (x, y) 的 w x h 窗口，按行存到 out
+ * 窗口里所有点的亚像素偏移相同，双线性权重只算一次，每行就是相邻两行像素的加权和。
+ * border 大于 0 表示 img 四周还有宽 border、复制了边缘像素的边框（ImagePyramid 的各层，见 borderWidth），
+ * 边框内的窗口直接读；超出可读范围的窗口逐点调用 sampleBilinear。两种情况都按复制边缘像素取值，结果相同
+ */
+inline void sampleWindow(const cv::Mat &img, float x, float y, int w, int h, float *out, int border = 0) {
+    // 窗口连同右边、下边的邻居都在可以直接读的范围里
+    if (x < -border || y < -border || x + w - 1 >= img.cols - 1 + border || y + h - 1 >= img.rows - 1 + border) {
+        for (int r = 0; r < h; r++)
+            for (int c = 0; c < w; c++)
+                out[r * w + c] = sampleBilinear(img, x + c, y + r);
+        return;
+    }
+    const int x0 = cvFloor(x), y0 = cvFloor(y);
+    const float xx = x - x0, yy = y - y0;
+    const float w00 = (1 - xx) * (1 - yy), w10 = xx * (1 - yy), w01 = (1 - xx) * yy, w11 = xx * yy;
+#ifdef __AVX2__
+    const __m256 v00 = _mm256_set1_ps(w00), v10 = _mm256_set1_ps(w10);
+    const __m256 v01 = _mm256_set1_ps(w01), v11 = _mm256_set1_ps(w11);
+    auto load8 = [](const uchar *p) {
+        return _mm256_cvtepi32_ps(_mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *) p)));
+    };
+#endif
+    for (int r = 0; r < h; r++) {
+        const uchar *row0 = img.data + ptrdiff_t(y0 + r) * img.step + x0;
+        const uchar *row1 = row0 + img.step;
+        float *dst = out + r * w;
+        int c = 0;
+#ifdef __AVX2__
+        for (; c + 8 <= w; c += 8) {
+            __m256 v = _mm256_mul_ps(v00, load8(row0 + c));
+            v = mulAdd(v10, load8(row0 + c + 1), v);
+            v = mulAdd(v01, load8(row1 + c), v);
+            v = mulAdd(v11, load8(row1 + c + 1), v);
+            _mm256_storeu_ps(dst + c, v);
+        }
+#endif
+        for (; c < w; c++)
+            dst[c] = w00 * row0[c] + w10 * row0[c + 1] + w01 * row1[c] + w11 * row1[c + 1];
+    }
+}
+
+/**
+ * 从 sampleWindow 取出的 w x h 窗口中，取去掉一圈边框后的 (w-2) x (h-2) 内部，
+ * 以及内部每个点的中心差分梯度，与直接对图像在 (x±1, y) 和 (x, y±1) 处插值再相减相同
+ */
+inline void windowGradient(const float *window, int w, int h, float *patch, float *grad_x, float *grad_y) {
+    const int pw = w - 2;
+    for (int r = 0; r < h - 2; r++) {
+        const float *src = window + (r + 1) * w + 1;
+        for (int c = 0; c < pw; c++) {
+            patch[r * pw + c] = src[c];
+            grad_x[r * pw + c] = 0.5f * (src[c + 1] - src[c - 1]);
+            grad_y[r * pw + c] = 0.5f * (src[c + w] - src[c - w]);
+        }
+    }
+}
+
+}  // namespace slambook
+
+#endif  // SLAMBOOK_IMAGE_SAMPLING_H